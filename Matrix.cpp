@@ -1,181 +1,4140 @@
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <memory_resource>
 #include <cassert>
+#include <chrono>
+#include <charconv>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <new>
+#include <random>
+#include <sstream>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
+namespace detail {
+
+// Tile sizes of the blocked product. An MR x NR block of C lives in registers,
+// a KC x NR sliver of packed B stays in L1 and an MC x KC block of packed A
+// stays in L2 while it is swept across the NC-wide panel of B.
+constexpr int gemmMR = 4;
+constexpr int gemmNR = 8;
+constexpr int gemmMC = 128;
+constexpr int gemmKC = 256;
+constexpr int gemmNC = 4096;
+
+// Copies alpha times an mc x kc block of A (strides rsa, csa) into MR-row
+// slivers stored column by column, zero-padding the last sliver so the
+// micro-kernel never needs an edge case.
+template<typename T>
+void packA(int mc, int kc, const T* a, ptrdiff_t rsa, ptrdiff_t csa, T alpha, T* buf) {
+
+    for (int i = 0; i < mc; i += gemmMR) {
+        int mr = min(gemmMR, mc - i);
+        for (int p = 0; p < kc; ++p) {
+            for (int r = 0; r < mr; ++r)
+                buf[r] = alpha * a[(i + r) * rsa + p * csa];
+            for (int r = mr; r < gemmMR; ++r)
+                buf[r] = T();
+            buf += gemmMR;
+        }
+    }
+}
+
+// Copies a kc x nc panel of B (strides rsb, csb) into NR-column slivers
+// stored row by row.
+template<typename T>
+void packB(int kc, int nc, const T* b, ptrdiff_t rsb, ptrdiff_t csb, T* buf) {
+
+    for (int j = 0; j < nc; j += gemmNR) {
+        int nr = min(gemmNR, nc - j);
+        for (int p = 0; p < kc; ++p) {
+            const T* row = b + p * rsb + j * csb;
+            for (int c = 0; c < nr; ++c)
+                buf[c] = row[c * csb];
+            for (int c = nr; c < gemmNR; ++c)
+                buf[c] = T();
+            buf += gemmNR;
+        }
+    }
+}
+
+// C[mr x nr] += A sliver * B sliver, accumulated in a full MR x NR register tile.
+template<typename T>
+void microKernel(int kc, const T* a, const T* b, T* c, int ldc, int mr, int nr) {
+
+    T acc[gemmMR][gemmNR] = {};
+
+    for (int p = 0; p < kc; ++p) {
+        for (int r = 0; r < gemmMR; ++r) {
+            T av = a[r];
+            for (int col = 0; col < gemmNR; ++col)
+                acc[r][col] += av * b[col];
+        }
+        a += gemmMR;
+        b += gemmNR;
+    }
+
+    for (int r = 0; r < mr; ++r)
+        for (int col = 0; col < nr; ++col)
+            c[r * ldc + col] += acc[r][col];
+}
+
+} // namespace detail
+
+// Explicit SSE2/AVX2/AVX-512 kernels, selected once at startup from CPUID so
+// a single binary runs on every host. Each ISA gets its own copy of the
+// generic kernels, compiled under that ISA's target options.
+namespace simd {
+
+enum class Isa { Scalar, SSE2, AVX2, AVX512 };
+
+inline Isa detectIsa() {
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return Isa::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return Isa::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return Isa::SSE2;
+#endif
+
+    return Isa::Scalar;
+}
+
+template<typename T>
+struct Kernels {
+    void (*add)(const T* a, const T* b, T* out, size_t n);
+    void (*sub)(const T* a, const T* b, T* out, size_t n);
+    void (*scale)(const T* a, T s, T* out, size_t n);
+    void (*microKernel)(int kc, const T* a, const T* b, T* c, int ldc, int mr, int nr);
+};
+
+namespace scalar {
+
+template<typename T>
+void add(const T* a, const T* b, T* out, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = a[i] + b[i];
+}
+
+template<typename T>
+void sub(const T* a, const T* b, T* out, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = a[i] - b[i];
+}
+
+template<typename T>
+void scale(const T* a, T s, T* out, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        out[i] = a[i] * s;
+}
+
+template<typename T>
+Kernels<T> table() {
+    return { add<T>, sub<T>, scale<T>, detail::microKernel<T> };
+}
+
+} // namespace scalar
+
+} // namespace simd
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATRIX_X86_SIMD 1
+#include <immintrin.h>
+
+// Generic kernels over a Vec<T> traits type. Expanded once per ISA namespace
+// below; the micro-kernel accumulates in the same order as the scalar one,
+// so integer results are bit-identical across ISAs.
+#define MATRIX_SIMD_KERNELS                                                        \
+    template<typename T>                                                           \
+    void add(const T* a, const T* b, T* out, size_t n) {                           \
+        using V = Vec<T>;                                                          \
+        size_t i = 0;                                                              \
+        for (; i + V::width <= n; i += V::width)                                   \
+            V::store(out + i, V::add(V::load(a + i), V::load(b + i)));             \
+        for (; i < n; ++i)                                                         \
+            out[i] = a[i] + b[i];                                                  \
+    }                                                                              \
+                                                                                   \
+    template<typename T>                                                           \
+    void sub(const T* a, const T* b, T* out, size_t n) {                           \
+        using V = Vec<T>;                                                          \
+        size_t i = 0;                                                              \
+        for (; i + V::width <= n; i += V::width)                                   \
+            V::store(out + i, V::sub(V::load(a + i), V::load(b + i)));             \
+        for (; i < n; ++i)                                                         \
+            out[i] = a[i] - b[i];                                                  \
+    }                                                                              \
+                                                                                   \
+    template<typename T>                                                           \
+    void scale(const T* a, T s, T* out, size_t n) {                                \
+        using V = Vec<T>;                                                          \
+        auto sv = V::set1(s);                                                      \
+        size_t i = 0;                                                              \
+        for (; i + V::width <= n; i += V::width)                                   \
+            V::store(out + i, V::mul(V::load(a + i), sv));                         \
+        for (; i < n; ++i)                                                         \
+            out[i] = a[i] * s;                                                     \
+    }                                                                              \
+                                                                                   \
+    template<typename T>                                                           \
+    void microKernel(int kc, const T* a, const T* b, T* c, int ldc, int mr, int nr) { \
+        using V = Vec<T>;                                                          \
+        constexpr int MR = detail::gemmMR;                                         \
+        constexpr int NR = detail::gemmNR;                                         \
+        constexpr int lanes = NR / V::width;                                       \
+        static_assert(lanes * V::width == NR, "NR must be a multiple of the vector width"); \
+                                                                                   \
+        typename V::type acc[MR][lanes];                                           \
+        for (int r = 0; r < MR; ++r)                                               \
+            for (int l = 0; l < lanes; ++l)                                        \
+                acc[r][l] = V::zero();                                             \
+                                                                                   \
+        for (int p = 0; p < kc; ++p) {                                             \
+            typename V::type bv[lanes];                                            \
+            for (int l = 0; l < lanes; ++l)                                        \
+                bv[l] = V::load(b + l * V::width);                                 \
+            for (int r = 0; r < MR; ++r) {                                         \
+                auto av = V::set1(a[r]);                                           \
+                for (int l = 0; l < lanes; ++l)                                    \
+                    acc[r][l] = V::add(acc[r][l], V::mul(av, bv[l]));              \
+            }                                                                      \
+            a += MR;                                                               \
+            b += NR;                                                               \
+        }                                                                          \
+                                                                                   \
+        if (mr == MR && nr == NR) {                                                \
+            for (int r = 0; r < MR; ++r) {                                         \
+                for (int l = 0; l < lanes; ++l) {                                  \
+                    T* dst = c + r * ldc + l * V::width;                           \
+                    V::store(dst, V::add(V::load(dst), acc[r][l]));                \
+                }                                                                  \
+            }                                                                      \
+            return;                                                                \
+        }                                                                          \
+                                                                                   \
+        T tile[MR][NR];                                                            \
+        for (int r = 0; r < MR; ++r)                                               \
+            for (int l = 0; l < lanes; ++l)                                        \
+                V::store(&tile[r][l * V::width], acc[r][l]);                       \
+        for (int r = 0; r < mr; ++r)                                               \
+            for (int col = 0; col < nr; ++col)                                     \
+                c[r * ldc + col] += tile[r][col];                                  \
+    }                                                                              \
+                                                                                   \
+    template<typename T>                                                           \
+    Kernels<T> table() {                                                           \
+        Kernels<T> k = { add<T>, sub<T>, scale<T>, nullptr };                      \
+        if constexpr (detail::gemmNR % Vec<T>::width == 0)                         \
+            k.microKernel = microKernel<T>;                                        \
+        return k;                                                                  \
+    }
+
+namespace simd {
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+namespace sse2 {
+
+template<typename T> struct Vec;
+
+template<> struct Vec<double> {
+    using type = __m128d;
+    static constexpr int width = 2;
+    static type load(const double* p) { return _mm_loadu_pd(p); }
+    static void store(double* p, type v) { _mm_storeu_pd(p, v); }
+    static type set1(double s) { return _mm_set1_pd(s); }
+    static type zero() { return _mm_setzero_pd(); }
+    static type add(type a, type b) { return _mm_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm_mul_pd(a, b); }
+};
+
+template<> struct Vec<float> {
+    using type = __m128;
+    static constexpr int width = 4;
+    static type load(const float* p) { return _mm_loadu_ps(p); }
+    static void store(float* p, type v) { _mm_storeu_ps(p, v); }
+    static type set1(float s) { return _mm_set1_ps(s); }
+    static type zero() { return _mm_setzero_ps(); }
+    static type add(type a, type b) { return _mm_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+};
+
+template<> struct Vec<int> {
+    using type = __m128i;
+    static constexpr int width = 4;
+    static type load(const int* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static void store(int* p, type v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+    static type set1(int s) { return _mm_set1_epi32(s); }
+    static type zero() { return _mm_setzero_si128(); }
+    static type add(type a, type b) { return _mm_add_epi32(a, b); }
+    static type sub(type a, type b) { return _mm_sub_epi32(a, b); }
+
+    // SSE2 has no 32-bit mullo: multiply even and odd lanes separately.
+    static type mul(type a, type b) {
+        type even = _mm_mul_epu32(a, b);
+        type odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+};
+
+MATRIX_SIMD_KERNELS
+
+} // namespace sse2
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+namespace avx2 {
+
+template<typename T> struct Vec;
+
+template<> struct Vec<double> {
+    using type = __m256d;
+    static constexpr int width = 4;
+    static type load(const double* p) { return _mm256_loadu_pd(p); }
+    static void store(double* p, type v) { _mm256_storeu_pd(p, v); }
+    static type set1(double s) { return _mm256_set1_pd(s); }
+    static type zero() { return _mm256_setzero_pd(); }
+    static type add(type a, type b) { return _mm256_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_pd(a, b); }
+};
+
+template<> struct Vec<float> {
+    using type = __m256;
+    static constexpr int width = 8;
+    static type load(const float* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, type v) { _mm256_storeu_ps(p, v); }
+    static type set1(float s) { return _mm256_set1_ps(s); }
+    static type zero() { return _mm256_setzero_ps(); }
+    static type add(type a, type b) { return _mm256_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+};
+
+template<> struct Vec<int> {
+    using type = __m256i;
+    static constexpr int width = 8;
+    static type load(const int* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static void store(int* p, type v) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v); }
+    static type set1(int s) { return _mm256_set1_epi32(s); }
+    static type zero() { return _mm256_setzero_si256(); }
+    static type add(type a, type b) { return _mm256_add_epi32(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_epi32(a, b); }
+    static type mul(type a, type b) { return _mm256_mullo_epi32(a, b); }
+};
+
+MATRIX_SIMD_KERNELS
+
+} // namespace avx2
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+namespace avx512 {
+
+template<typename T> struct Vec;
+
+template<> struct Vec<double> {
+    using type = __m512d;
+    static constexpr int width = 8;
+    static type load(const double* p) { return _mm512_loadu_pd(p); }
+    static void store(double* p, type v) { _mm512_storeu_pd(p, v); }
+    static type set1(double s) { return _mm512_set1_pd(s); }
+    static type zero() { return _mm512_setzero_pd(); }
+    static type add(type a, type b) { return _mm512_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm512_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm512_mul_pd(a, b); }
+};
+
+template<> struct Vec<float> {
+    using type = __m512;
+    static constexpr int width = 16;
+    static type load(const float* p) { return _mm512_loadu_ps(p); }
+    static void store(float* p, type v) { _mm512_storeu_ps(p, v); }
+    static type set1(float s) { return _mm512_set1_ps(s); }
+    static type zero() { return _mm512_setzero_ps(); }
+    static type add(type a, type b) { return _mm512_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm512_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm512_mul_ps(a, b); }
+};
+
+template<> struct Vec<int> {
+    using type = __m512i;
+    static constexpr int width = 16;
+    static type load(const int* p) { return _mm512_loadu_si512(p); }
+    static void store(int* p, type v) { _mm512_storeu_si512(p, v); }
+    static type set1(int s) { return _mm512_set1_epi32(s); }
+    static type zero() { return _mm512_setzero_si512(); }
+    static type add(type a, type b) { return _mm512_add_epi32(a, b); }
+    static type sub(type a, type b) { return _mm512_sub_epi32(a, b); }
+    static type mul(type a, type b) { return _mm512_mullo_epi32(a, b); }
+};
+
+MATRIX_SIMD_KERNELS
+
+} // namespace avx512
+
+#pragma GCC pop_options
+
+} // namespace simd
+
+#endif
+
+namespace simd {
+
+template<typename T>
+struct IsVectorizable : integral_constant<bool, is_same<T, int>::value
+                                              || is_same<T, float>::value
+                                              || is_same<T, double>::value> {};
+
+// Kernel table for a given ISA; types without vector kernels, and ISAs the
+// build cannot target, fall back to the scalar loops.
+template<typename T>
+Kernels<T> kernelsFor(Isa isa) {
+
+#ifdef MATRIX_X86_SIMD
+    if constexpr (IsVectorizable<T>::value) {
+        switch (isa) {
+        case Isa::AVX512: {
+            // 16-lane float/int vectors are wider than an NR-column sliver.
+            Kernels<T> k = avx512::table<T>();
+            if (!k.microKernel)
+                k.microKernel = avx2::microKernel<T>;
+            return k;
+        }
+        case Isa::AVX2:
+            return avx2::table<T>();
+        case Isa::SSE2:
+            return sse2::table<T>();
+        case Isa::Scalar:
+            break;
+        }
+    }
+#endif
+
+    (void)isa;
+    return scalar::table<T>();
+}
+
+inline Isa activeIsa() {
+    static const Isa isa = detectIsa();
+    return isa;
+}
+
+template<typename T>
+const Kernels<T>& kernels() {
+    static const Kernels<T> k = kernelsFor<T>(activeIsa());
+    return k;
+}
+
+} // namespace simd
+
+namespace detail {
+
+// Per-thread packing buffer that only ever grows, so steady-state products
+// do not touch the heap.
+template<typename T, int Slot>
+T* packBuffer(size_t n) {
+
+    static thread_local vector<T> buffer;
+    if (buffer.size() < n)
+        buffer.resize(n);
+    return buffer.data();
+}
+
+// C (m x n) += alpha * A (m x k) * B (k x n). A and B take row and column
+// strides; C is row-major with leading dimension ldc. The micro-kernel is the
+// active ISA's unless one is passed in.
+template<typename T>
+void gemmBlocked(int m, int n, int k, T alpha,
+                 const T* a, ptrdiff_t rsa, ptrdiff_t csa,
+                 const T* b, ptrdiff_t rsb, ptrdiff_t csb,
+                 T* c, ptrdiff_t ldc,
+                 decltype(simd::Kernels<T>::microKernel) kernel = nullptr) {
+
+    if (!kernel)
+        kernel = simd::kernels<T>().microKernel;
+    T* packedA = packBuffer<T, 0>(static_cast<size_t>(gemmMC) * gemmKC);
+    T* packedB = packBuffer<T, 1>(static_cast<size_t>(gemmKC) * (gemmNC + gemmNR));
+
+    for (int jc = 0; jc < n; jc += gemmNC) {
+        int nc = min(gemmNC, n - jc);
+
+        for (int pc = 0; pc < k; pc += gemmKC) {
+            int kc = min(gemmKC, k - pc);
+            packB(kc, nc, b + pc * rsb + jc * csb, rsb, csb, packedB);
+
+            for (int ic = 0; ic < m; ic += gemmMC) {
+                int mc = min(gemmMC, m - ic);
+                packA(mc, kc, a + ic * rsa + pc * csa, rsa, csa, alpha, packedA);
+
+                for (int jr = 0; jr < nc; jr += gemmNR) {
+                    for (int ir = 0; ir < mc; ir += gemmMR) {
+                        kernel(kc,
+                               packedA + ir * kc,
+                               packedB + jr * kc,
+                               c + (ic + ir) * ldc + jc + jr, ldc,
+                               min(gemmMR, mc - ir), min(gemmNR, nc - jr));
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Cache-oblivious out-of-place transpose: dst (cols x rows) = src (rows x cols)
+// transposed. The longer side is halved until a block fits in L1, so both the
+// reads and the strided writes stay cache-resident at every level.
+template<typename T>
+void transposeBlock(int rows, int cols, const T* src, int lds, T* dst, int ldd) {
+
+    constexpr int leaf = 32;
+
+    if (rows <= leaf && cols <= leaf) {
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+                dst[static_cast<size_t>(j) * ldd + i] = src[static_cast<size_t>(i) * lds + j];
+        return;
+    }
+
+    if (rows >= cols) {
+        int h = rows / 2;
+        transposeBlock(h, cols, src, lds, dst, ldd);
+        transposeBlock(rows - h, cols, src + static_cast<size_t>(h) * lds, lds, dst + h, ldd);
+    } else {
+        int h = cols / 2;
+        transposeBlock(rows, h, src, lds, dst, ldd);
+        transposeBlock(rows, cols - h, src + h, lds, dst + static_cast<size_t>(h) * ldd, ldd);
+    }
+}
+
+// Swaps the rows x cols block at a with the transpose of the cols x rows block
+// at b, halving the longer side like transposeBlock().
+template<typename T>
+void swapTransposed(int rows, int cols, T* a, T* b, int ld) {
+
+    constexpr int leaf = 32;
+
+    if (rows <= leaf && cols <= leaf) {
+        for (int i = 0; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+                swap(a[static_cast<size_t>(i) * ld + j], b[static_cast<size_t>(j) * ld + i]);
+        return;
+    }
+
+    if (rows >= cols) {
+        int h = rows / 2;
+        swapTransposed(h, cols, a, b, ld);
+        swapTransposed(rows - h, cols, a + static_cast<size_t>(h) * ld, b + h, ld);
+    } else {
+        int h = cols / 2;
+        swapTransposed(rows, h, a, b, ld);
+        swapTransposed(rows, cols - h, a + h, b + static_cast<size_t>(h) * ld, ld);
+    }
+}
+
+// In-place transpose of an n x n block: recurse on the diagonal quadrants and
+// swap the off-diagonal ones.
+template<typename T>
+void transposeSquare(int n, T* a, int ld) {
+
+    if (n <= 32) {
+        for (int i = 0; i < n; ++i)
+            for (int j = i + 1; j < n; ++j)
+                swap(a[static_cast<size_t>(i) * ld + j], a[static_cast<size_t>(j) * ld + i]);
+        return;
+    }
+
+    int h = n / 2;
+    T* a21 = a + static_cast<size_t>(h) * ld;
+    transposeSquare(h, a, ld);
+    transposeSquare(n - h, a21 + h, ld);
+    swapTransposed(h, n - h, a + h, a21, ld);
+}
+
+// In-place transpose of a contiguous rows x cols buffer by following the
+// cycles of the permutation k -> k * rows mod (size - 1). One bit per element
+// marks visited positions instead of a second copy of the data.
+template<typename T>
+void transposeCycles(int rows, int cols, T* a) {
+
+    size_t size = static_cast<size_t>(rows) * cols;
+    if (size < 3)
+        return;
+
+    size_t last = size - 1;
+    vector<bool> visited(size);
+
+    for (size_t start = 1; start < last; ++start) {
+        if (visited[start])
+            continue;
+
+        size_t k = start;
+        T carried = move(a[start]);
+        do {
+            size_t next = k * rows % last;
+            swap(carried, a[next]);
+            visited[next] = true;
+            k = next;
+        } while (k != start);
+    }
+}
+
+} // namespace detail
+
+// Fixed set of worker threads shared by every parallel Matrix operation. The
+// calling thread works alongside the pool, so a pool of N threads starts N - 1
+// workers. One job runs at a time; nested calls from a task run inline.
+class ThreadPool {
+public:
+
+    // With pinned set, worker i is bound to CPU i modulo the CPU count; the
+    // thread that calls parallelFor() runs task 0 and pins itself, if at all.
+    explicit ThreadPool(unsigned threads, bool pinned = false) {
+
+        if (threads == 0)
+            threads = 1;
+
+        unsigned cpus = max(1u, thread::hardware_concurrency());
+        for (unsigned i = 1; i < threads; ++i) {
+            workers_.emplace_back([this, pinned, cpu = i % cpus] {
+                if (pinned)
+                    pinCurrentThread(cpu);
+                workerLoop();
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+
+        for (auto& w : workers_)
+            w.join();
+    }
+
+    unsigned threadCount() const noexcept {
+        return static_cast<unsigned>(workers_.size()) + 1;
+    }
+
+    // Runs body(task) for every task in [0, tasks) and returns when all are
+    // done. If a task throws, the tasks not yet started are skipped, and the
+    // first exception is rethrown here once every thread has let go of body.
+    void parallelFor(size_t tasks, const function<void(size_t)>& body) {
+
+        if (workers_.empty() || tasks <= 1 || insideTask()) {
+            for (size_t i = 0; i < tasks; ++i)
+                body(i);
+            return;
+        }
+
+        lock_guard<mutex> submit(submitMutex_);
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            body_ = &body;
+            tasks_ = tasks;
+            next_ = 0;
+            pending_ = workers_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        runTasks(body, tasks);
+
+        unique_lock<mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+        body_ = nullptr;
+
+        if (error_) {
+            exception_ptr error = move(error_);
+            error_ = nullptr;
+            lock.unlock();
+            rethrow_exception(error);
+        }
+    }
+
+    // Process-wide pool, sized to the hardware unless setGlobalThreadCount()
+    // was called first.
+    static ThreadPool& global() {
+
+        lock_guard<mutex> lock(globalMutex());
+        auto& pool = globalPool();
+        if (!pool)
+            pool = make_unique<ThreadPool>(max(1u, thread::hardware_concurrency()));
+        return *pool;
+    }
+
+    // Replaces the global pool; must not race with running parallel work.
+    static void setGlobalThreadCount(unsigned threads, bool pinned = false) {
+
+        lock_guard<mutex> lock(globalMutex());
+        globalPool() = make_unique<ThreadPool>(threads, pinned);
+    }
+
+    // Binds the calling thread to one CPU; returns false where unsupported.
+    static bool pinCurrentThread(unsigned cpu) {
+
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
+private:
+    vector<thread> workers_;
+    mutex submitMutex_;
+    mutex mutex_;
+    condition_variable wake_;
+    condition_variable done_;
+    const function<void(size_t)>* body_ = nullptr;
+    size_t tasks_ = 0;
+    size_t pending_ = 0;
+    size_t generation_ = 0;
+    atomic<size_t> next_{0};
+    exception_ptr error_;
+    bool stop_ = false;
+
+    static bool& insideTask() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    static mutex& globalMutex() {
+        static mutex m;
+        return m;
+    }
+
+    static unique_ptr<ThreadPool>& globalPool() {
+        static unique_ptr<ThreadPool> pool;
+        return pool;
+    }
+
+    // Never throws: the first exception is kept for parallelFor() to rethrow.
+    void runTasks(const function<void(size_t)>& body, size_t tasks) noexcept {
+
+        struct InsideTask {
+            InsideTask() { insideTask() = true; }
+            ~InsideTask() { insideTask() = false; }
+        } inside;
+
+        try {
+            for (size_t i = next_.fetch_add(1); i < tasks; i = next_.fetch_add(1))
+                body(i);
+        } catch (...) {
+            next_ = tasks;
+            lock_guard<mutex> lock(mutex_);
+            if (!error_)
+                error_ = current_exception();
+        }
+    }
+
+    void workerLoop() {
+
+        size_t seen = 0;
+
+        for (;;) {
+            const function<void(size_t)>* body;
+            size_t tasks;
+
+            {
+                unique_lock<mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_)
+                    return;
+                seen = generation_;
+                body = body_;
+                tasks = tasks_;
+            }
+
+            runTasks(*body, tasks);
+
+            lock_guard<mutex> lock(mutex_);
+            if (--pending_ == 0)
+                done_.notify_one();
+        }
+    }
+};
+
+// Execution policies for the free-function Matrix API.
+namespace exec {
+
+struct sequential_policy {};
+struct parallel_policy {};
+
+constexpr sequential_policy seq{};
+constexpr parallel_policy parallel{};
+
+// Work below these sizes stays on the calling thread.
+constexpr long long parallelGemmThreshold = 128LL * 128 * 128;
+constexpr size_t parallelElementThreshold = size_t(1) << 16;
+constexpr size_t elementChunk = size_t(1) << 14;
+
+inline void set_thread_count(unsigned threads, bool pinned = false) {
+    ThreadPool::setGlobalThreadCount(threads, pinned);
+}
+
+inline unsigned thread_count() {
+    return ThreadPool::global().threadCount();
+}
+
+} // namespace exec
+
+namespace detail {
+
+// Owning Matrix storage: 64-byte aligned, obtained from a pluggable
+// memory_resource, and constructed in a single pass. With initialize ==
+// false trivially constructible elements are left untouched, so a buffer that
+// is about to be overwritten costs no extra memory traffic.
+template<typename T>
+class MatrixBuffer {
+public:
+    static constexpr size_t alignment = alignof(T) > 64 ? alignof(T) : 64;
+
+    MatrixBuffer() noexcept = default;
+
+    MatrixBuffer(size_t count, bool initialize, pmr::memory_resource* resource)
+        : count_(count), resource_(resource)
+    {
+        if (count_ == 0)
+            return;
+
+        data_ = static_cast<T*>(resource_->allocate(count_ * sizeof(T), alignment));
+
+        if (initialize || !is_trivially_default_constructible<T>::value)
+            uninitialized_value_construct_n(data_, count_);
+    }
+
+    MatrixBuffer(MatrixBuffer&& other) noexcept
+        : data_(other.data_), count_(other.count_), resource_(other.resource_)
+    {
+        other.data_ = nullptr;
+        other.count_ = 0;
+    }
+
+    MatrixBuffer& operator=(MatrixBuffer&& other) noexcept {
+
+        if (this != &other) {
+            release();
+            data_ = other.data_;
+            count_ = other.count_;
+            resource_ = other.resource_;
+            other.data_ = nullptr;
+            other.count_ = 0;
+        }
+
+        return *this;
+    }
+
+    ~MatrixBuffer() {
+        release();
+    }
+
+    T* get() const noexcept {
+        return data_;
+    }
+
+    size_t size() const noexcept {
+        return count_;
+    }
+
+    pmr::memory_resource* resource() const noexcept {
+        return resource_;
+    }
+
+    T& operator[](size_t i) const noexcept {
+        return data_[i];
+    }
+
+private:
+    T* data_ = nullptr;
+    size_t count_ = 0;
+    pmr::memory_resource* resource_ = nullptr;
+
+    void release() noexcept {
+
+        if (!data_)
+            return;
+
+        destroy_n(data_, count_);
+        resource_->deallocate(data_, count_ * sizeof(T), alignment);
+        data_ = nullptr;
+        count_ = 0;
+    }
+};
+
+} // namespace detail
+
+// Memory resource that backs each allocation with its own anonymous mapping,
+// rounded to 2 MB and marked for transparent huge pages. Pages are placed on
+// the NUMA node of the thread that first touches them, so pairing this with
+// Matrix(rows, cols, uninitialized, resource) and a parallel first write
+// keeps every partition node-local.
+class HugePageResource : public pmr::memory_resource {
+public:
+    static constexpr size_t hugePageSize = size_t(2) << 20;
+
+private:
+    static size_t rounded(size_t bytes) noexcept {
+        return (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+    }
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+
+        if (alignment > hugePageSize)
+            throw bad_alloc();
+
+        void* p = mmap(nullptr, rounded(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+        madvise(p, rounded(bytes), MADV_HUGEPAGE);
+#endif
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t) override {
+        munmap(p, rounded(bytes));
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+// Tag for constructors that leave trivially constructible elements
+// uninitialized because the caller is about to overwrite all of them.
+struct uninitialized_t {};
+constexpr uninitialized_t uninitialized{};
+
+// Extent of a Matrix dimension that is only known at run time.
+constexpr int dynamicExtent = -1;
+
+template<typename T, int R = dynamicExtent, int C = dynamicExtent>
+class Matrix;
+
+// Lazy Matrix arithmetic. +, - and scalar * build lightweight expression nodes
+// that are evaluated in one fused pass when assigned to a Matrix, so a chain
+// like a + b - c allocates only the result. Matrix operands are held by
+// reference and inner nodes by value; an expression must not outlive the
+// matrices it refers to.
+//
+// Every node provides value_type, rows(), cols() and an unchecked
+// coeff(i, j). Nodes whose elements depend only on the same element of their
+// operands set elementwise and also provide coeff(idx) over the flat buffer.
+template<typename E>
+class MatrixExpr {
+public:
+    const E& self() const noexcept {
+        return static_cast<const E&>(*this);
+    }
+};
+
+template<typename E>
+struct IsMatrix : false_type {};
+
+template<typename T, int R, int C>
+struct IsMatrix<Matrix<T, R, C>> : true_type {};
+
+template<typename T>
+class MappedMatrix;
+
+template<typename T>
+struct IsMatrix<MappedMatrix<T>> : true_type {};
+
+// Extents known at compile time, dynamicExtent otherwise.
+template<typename E>
+struct StaticExtents {
+    static constexpr int rows = dynamicExtent;
+    static constexpr int cols = dynamicExtent;
+};
+
+template<typename T, int R, int C>
+struct StaticExtents<Matrix<T, R, C>> {
+    static constexpr int rows = R;
+    static constexpr int cols = C;
+};
+
+template<int A, int B>
+struct ExtentsMatch : integral_constant<bool, A == dynamicExtent || B == dynamicExtent || A == B> {};
+
+template<typename E>
+using ExprOperand = conditional_t<IsMatrix<E>::value, const E&, const E>;
+
+struct AddOp {
+    static constexpr const char* name = "addition";
+
+    template<typename T>
+    static T apply(const T& a, const T& b) {
+        return a + b;
+    }
+};
+
+struct SubOp {
+    static constexpr const char* name = "subtraction";
+
+    template<typename T>
+    static T apply(const T& a, const T& b) {
+        return a - b;
+    }
+};
+
+template<typename L, typename R, typename Op>
+class BinaryExpr : public MatrixExpr<BinaryExpr<L, R, Op>> {
+public:
+    using value_type = typename L::value_type;
+    static constexpr bool elementwise = L::elementwise && R::elementwise;
+
+    static_assert(is_same<value_type, typename R::value_type>::value,
+                  "Matrix operands must have the same element type");
+    static_assert(ExtentsMatch<StaticExtents<L>::rows, StaticExtents<R>::rows>::value
+                  && ExtentsMatch<StaticExtents<L>::cols, StaticExtents<R>::cols>::value,
+                  "Incompatible dimensions");
+
+    // Mismatched operands report the error once and evaluate to a 0x0 matrix.
+    BinaryExpr(const L& lhs, const R& rhs)
+        : lhs_(lhs), rhs_(rhs), rows_(lhs.rows()), cols_(lhs.cols())
+    {
+        if (lhs.rows() != rhs.rows() || lhs.cols() != rhs.cols()) {
+            cerr << "Error: Incompatible dimensions for " << Op::name << "\n";
+            rows_ = cols_ = 0;
+        }
+    }
+
+    int rows() const noexcept {
+        return rows_;
+    }
+
+    int cols() const noexcept {
+        return cols_;
+    }
+
+    value_type coeff(int i, int j) const {
+        return Op::apply(lhs_.coeff(i, j), rhs_.coeff(i, j));
+    }
+
+    value_type coeff(size_t idx) const {
+        return Op::apply(lhs_.coeff(idx), rhs_.coeff(idx));
+    }
+
+    const L& lhs() const noexcept {
+        return lhs_;
+    }
+
+    const R& rhs() const noexcept {
+        return rhs_;
+    }
+
+private:
+    ExprOperand<L> lhs_;
+    ExprOperand<R> rhs_;
+    int rows_, cols_;
+};
+
+template<typename E>
+class ScaleExpr : public MatrixExpr<ScaleExpr<E>> {
+public:
+    using value_type = typename E::value_type;
+    static constexpr bool elementwise = E::elementwise;
+
+    ScaleExpr(const E& e, const value_type& s)
+        : e_(e), s_(s) {}
+
+    int rows() const noexcept {
+        return e_.rows();
+    }
+
+    int cols() const noexcept {
+        return e_.cols();
+    }
+
+    value_type coeff(int i, int j) const {
+        return e_.coeff(i, j) * s_;
+    }
+
+    value_type coeff(size_t idx) const {
+        return e_.coeff(idx) * s_;
+    }
+
+    const E& operand() const noexcept {
+        return e_;
+    }
+
+    const value_type& scalar() const noexcept {
+        return s_;
+    }
+
+private:
+    ExprOperand<E> e_;
+    value_type s_;
+};
+
+// Transpose as a view: no copy is made until the expression is assigned.
+template<typename E>
+class TransposeExpr : public MatrixExpr<TransposeExpr<E>> {
+public:
+    using value_type = typename E::value_type;
+    static constexpr bool elementwise = false;
+
+    explicit TransposeExpr(const E& e)
+        : e_(e) {}
+
+    int rows() const noexcept {
+        return e_.cols();
+    }
+
+    int cols() const noexcept {
+        return e_.rows();
+    }
+
+    value_type coeff(int i, int j) const {
+        return e_.coeff(j, i);
+    }
+
+    const E& operand() const noexcept {
+        return e_;
+    }
+
+private:
+    ExprOperand<E> e_;
+};
+
+// Non-owning strided window onto matrix storage: element (i, j) lives at
+// data[i * rowStride + j * colStride]. Blocks, rows, columns and transposes
+// are all views of the same buffer, so blocked and partitioned algorithms can
+// work on parts of a matrix without copying. Copying a view rebinds nothing:
+// assignment writes elements through it, like assigning to a Matrix.
+template<typename T>
+class MatrixView : public MatrixExpr<MatrixView<T>> {
+public:
+    using value_type = remove_const_t<T>;
+    static constexpr bool elementwise = false;
+
+    MatrixView(T* data, int rows, int cols, ptrdiff_t rowStride, ptrdiff_t colStride = 1) noexcept
+        : data_(data), rows_(rows), cols_(cols), rowStride_(rowStride), colStride_(colStride) {}
+
+    MatrixView(const MatrixView&) = default;
+
+    // A mutable view converts to a read-only one.
+    template<typename U, typename = enable_if_t<is_same<const U, T>::value>>
+    MatrixView(const MatrixView<U>& other) noexcept
+        : MatrixView(other.data(), other.rows(), other.cols(), other.rowStride(), other.colStride()) {}
+
+    MatrixView& operator=(const MatrixView& other) {
+        return *this = static_cast<const MatrixExpr<MatrixView>&>(other);
+    }
+
+    // Writes the expression element by element into the viewed region. The
+    // expression may read the element being written but no other element of
+    // this view.
+    template<typename E>
+    MatrixView& operator=(const MatrixExpr<E>& e) {
+
+        static_assert(!is_const<T>::value, "Cannot assign through a read-only view");
+
+        const E& expr = e.self();
+        if (expr.rows() != rows_ || expr.cols() != cols_) {
+            cerr << "Error: Incompatible dimensions for assignment\n";
+            return *this;
+        }
+
+        for (int i = 0; i < rows_; ++i)
+            for (int j = 0; j < cols_; ++j)
+                coeff(i, j) = expr.coeff(i, j);
+
+        return *this;
+    }
+
+    template<typename E>
+    MatrixView& operator+=(const MatrixExpr<E>& e) {
+        return *this = *this + e.self();
+    }
+
+    template<typename E>
+    MatrixView& operator-=(const MatrixExpr<E>& e) {
+        return *this = *this - e.self();
+    }
+
+    MatrixView& operator*=(const value_type& s) {
+        return *this = *this * s;
+    }
+
+    void fill(const value_type& v) {
+
+        static_assert(!is_const<T>::value, "Cannot assign through a read-only view");
+
+        for (int i = 0; i < rows_; ++i)
+            for (int j = 0; j < cols_; ++j)
+                coeff(i, j) = v;
+    }
+
+    T& operator()(int i, int j) const {
+
+        if (i < 0 || i >= rows_ || j < 0 || j >= cols_) {
+            cerr << "Error: Index out of bounds\n";
+            return data_[0];
+        }
+
+        return coeff(i, j);
+    }
+
+    T& coeff(int i, int j) const noexcept {
+        return data_[i * rowStride_ + j * colStride_];
+    }
+
+    int rows() const noexcept {
+        return rows_;
+    }
+
+    int cols() const noexcept {
+        return cols_;
+    }
+
+    ptrdiff_t rowStride() const noexcept {
+        return rowStride_;
+    }
+
+    ptrdiff_t colStride() const noexcept {
+        return colStride_;
+    }
+
+    T* data() const noexcept {
+        return data_;
+    }
+
+    // h x w window starting at (r0, c0); out-of-range requests give an empty view.
+    MatrixView block(int r0, int c0, int h, int w) const {
+
+        if (r0 < 0 || c0 < 0 || h < 0 || w < 0 || r0 + h > rows_ || c0 + w > cols_) {
+            cerr << "Error: Index out of bounds\n";
+            return MatrixView(data_, 0, 0, rowStride_, colStride_);
+        }
+
+        return MatrixView(data_ + r0 * rowStride_ + c0 * colStride_, h, w, rowStride_, colStride_);
+    }
+
+    MatrixView row(int i) const {
+        return block(i, 0, 1, cols_);
+    }
+
+    MatrixView col(int j) const {
+        return block(0, j, rows_, 1);
+    }
+
+    MatrixView transposed() const noexcept {
+        return MatrixView(data_, cols_, rows_, colStride_, rowStride_);
+    }
+
+private:
+    T* data_;
+    int rows_, cols_;
+    ptrdiff_t rowStride_, colStride_;
+};
+
+template<typename L, typename R>
+BinaryExpr<L, R, AddOp> operator+(const MatrixExpr<L>& a, const MatrixExpr<R>& b) {
+    return BinaryExpr<L, R, AddOp>(a.self(), b.self());
+}
+
+template<typename L, typename R>
+BinaryExpr<L, R, SubOp> operator-(const MatrixExpr<L>& a, const MatrixExpr<R>& b) {
+    return BinaryExpr<L, R, SubOp>(a.self(), b.self());
+}
+
+template<typename E>
+ScaleExpr<E> operator*(const MatrixExpr<E>& e, const typename E::value_type& s) {
+    return ScaleExpr<E>(e.self(), s);
+}
+
+template<typename E>
+ScaleExpr<E> operator*(const typename E::value_type& s, const MatrixExpr<E>& e) {
+    return ScaleExpr<E>(e.self(), s);
+}
+
+template<typename E>
+TransposeExpr<E> transpose_view(const MatrixExpr<E>& e) {
+    return TransposeExpr<E>(e.self());
+}
+
+template<typename T>
+class Matrix<T, dynamicExtent, dynamicExtent> : public MatrixExpr<Matrix<T>> {
+public:
+    using value_type = T;
+    static constexpr bool elementwise = true;
+
+    // Products with at least this many multiply-adds use the blocked kernel.
+    static constexpr long long blockedThreshold = 64LL * 64 * 64;
+
+    // Rows are padded to a whole number of 64-byte lines once they are at
+    // least a line long; ld() is the resulting row stride in elements.
+    Matrix(int rows, int cols, pmr::memory_resource* resource = pmr::get_default_resource())
+        : rows_(rows), cols_(cols), ld_(paddedStride(cols)), data_(storageSize(), true, resource) {}
+
+    Matrix(int rows, int cols, uninitialized_t, pmr::memory_resource* resource = pmr::get_default_resource())
+        : rows_(rows), cols_(cols), ld_(paddedStride(cols)), data_(storageSize(), false, resource)
+    {
+        clearPadding();
+    }
+
+    Matrix(const Matrix& other)
+        : rows_(other.rows_), cols_(other.cols_), ld_(other.ld_),
+          data_(other.storageSize(), false, other.data_.resource())
+    {
+        copy(other.data_.get(), other.data_.get() + storageSize(), data_.get());
+    }
+
+    Matrix(Matrix&& other) noexcept
+        : rows_(other.rows_), cols_(other.cols_), ld_(other.ld_), data_(move(other.data_))
+    {
+        other.rows_ = other.cols_ = other.ld_ = 0;
+    }
+
+    // Evaluates an expression straight into the new buffer, no temporaries.
+    template<typename E>
+    Matrix(const MatrixExpr<E>& e, pmr::memory_resource* resource = pmr::get_default_resource())
+        : Matrix(e.self().rows(), e.self().cols(), uninitialized, resource)
+    {
+        assign(e.self());
+    }
+
+    // Reuses the current buffer when it already has the right size.
+    Matrix& operator=(const Matrix& other) {
+
+        if (this != &other) {
+            if (data_.size() != other.storageSize())
+                data_ = detail::MatrixBuffer<T>(other.storageSize(), false, data_.resource()
+                                                ? data_.resource() : other.data_.resource());
+            rows_ = other.rows_;
+            cols_ = other.cols_;
+            ld_ = other.ld_;
+            copy(other.data_.get(), other.data_.get() + storageSize(), data_.get());
+        }
+
+        return *this;
+    }
+
+    Matrix& operator=(Matrix&& other) noexcept {
+
+        if (this != &other) {
+            rows_ = other.rows_;
+            cols_ = other.cols_;
+            ld_ = other.ld_;
+            data_ = move(other.data_);
+            other.rows_ = other.cols_ = other.ld_ = 0;
+        }
+
+        return *this;
+    }
+
+    // Elementwise expressions are evaluated in place when the shape already
+    // matches, which is safe even if the target is one of the operands.
+    template<typename E>
+    Matrix& operator=(const MatrixExpr<E>& e) {
+
+        const E& expr = e.self();
+
+        if (E::elementwise && expr.rows() == rows_ && expr.cols() == cols_)
+            assign(expr);
+        else
+            *this = Matrix(expr);
+
+        return *this;
+    }
+
+    T& operator()(int i, int j) {
+
+        if (i < 0 || i >= rows_ || j < 0 || j >= cols_) {
+            cerr << "Error: Index out of bounds\n";
+            return data_[0];
+        }
+
+        return data_[static_cast<size_t>(i) * ld_ + j];
+    }
+
+    const T& operator()(int i, int j) const {
+
+        if (i < 0 || i >= rows_ || j < 0 || j >= cols_) {
+            cerr << "Error: Index out of bounds\n";
+            return data_[0];
+        }
+
+        return data_[static_cast<size_t>(i) * ld_ + j];
+    }
+
+    int rows() const noexcept { 
+        return rows_; 
+    }
+
+    int cols() const noexcept { 
+        return cols_; 
+    }
+
+    size_t size() const noexcept {
+        return static_cast<size_t>(rows_) * cols_;
+    }
+
+    int ld() const noexcept {
+        return ld_;
+    }
+
+    // Elements in the buffer, row padding included.
+    size_t storageSize() const noexcept {
+        return static_cast<size_t>(rows_) * ld_;
+    }
+
+    T* data() noexcept {
+        return data_.get();
+    }
+
+    const T* data() const noexcept {
+        return data_.get();
+    }
+
+    MatrixView<T> view() noexcept {
+        return MatrixView<T>(data(), rows_, cols_, ld_);
+    }
+
+    MatrixView<const T> view() const noexcept {
+        return MatrixView<const T>(data(), rows_, cols_, ld_);
+    }
+
+    MatrixView<T> block(int r0, int c0, int h, int w) {
+        return view().block(r0, c0, h, w);
+    }
+
+    MatrixView<const T> block(int r0, int c0, int h, int w) const {
+        return view().block(r0, c0, h, w);
+    }
+
+    MatrixView<T> row(int i) {
+        return view().row(i);
+    }
+
+    MatrixView<const T> row(int i) const {
+        return view().row(i);
+    }
+
+    MatrixView<T> col(int j) {
+        return view().col(j);
+    }
+
+    MatrixView<const T> col(int j) const {
+        return view().col(j);
+    }
+
+    // Writes the matrix in the binary format read by MappedMatrix.
+    bool save(const char* path) const;
+
+    friend ostream& operator<<(ostream& os, const Matrix& m) {
+
+        for (int i = 0; i < m.rows_; ++i) {
+            for (int j = 0; j < m.cols_; ++j)
+                os << m(i, j) << (j + 1 < m.cols_ ? ' ' : '\n');
+        }
+
+        return os;
+    }
+
+    // Compound assignment works in place and never allocates for matrix or
+    // elementwise operands; a mismatched operand leaves the matrix unchanged.
+    template<typename E>
+    Matrix& operator+=(const MatrixExpr<E>& e) {
+
+        if (e.self().rows() != rows_ || e.self().cols() != cols_) {
+            cerr << "Error: Incompatible dimensions for addition\n";
+            return *this;
+        }
+
+        return *this = *this + e.self();
+    }
+
+    template<typename E>
+    Matrix& operator-=(const MatrixExpr<E>& e) {
+
+        if (e.self().rows() != rows_ || e.self().cols() != cols_) {
+            cerr << "Error: Incompatible dimensions for subtraction\n";
+            return *this;
+        }
+
+        return *this = *this - e.self();
+    }
+
+    Matrix& operator*=(const T& s) {
+        return *this = *this * s;
+    }
+
+    const T& coeff(int i, int j) const noexcept {
+        return data_[static_cast<size_t>(i) * ld_ + j];
+    }
+
+    // Flat index into the padded buffer; matrices of the same shape share a
+    // layout, so elementwise expressions can walk their buffers in lockstep.
+    const T& coeff(size_t idx) const noexcept {
+        return data_[idx];
+    }
+
+private:
+    int rows_, cols_, ld_;
+    detail::MatrixBuffer<T> data_;
+
+    static int paddedStride(int cols) noexcept {
+
+        constexpr int line = 64 % sizeof(T) == 0 ? static_cast<int>(64 / sizeof(T)) : 1;
+        return cols < line ? cols : (cols + line - 1) / line * line;
+    }
+
+    void clearPadding() {
+
+        if (ld_ == cols_)
+            return;
+
+        for (int i = 0; i < rows_; ++i)
+            fill(data_.get() + static_cast<size_t>(i) * ld_ + cols_,
+                 data_.get() + static_cast<size_t>(i + 1) * ld_, T());
+    }
+
+    template<typename E>
+    void assign(const E& e) {
+
+        if constexpr (E::elementwise) {
+            size_t n = storageSize();
+            for (size_t idx = 0; idx < n; ++idx)
+                data_[idx] = e.coeff(idx);
+        } else {
+            for (int i = 0; i < rows_; ++i)
+                for (int j = 0; j < cols_; ++j)
+                    data_[static_cast<size_t>(i) * ld_ + j] = e.coeff(i, j);
+        }
+    }
+
+    // Single-operation expressions on plain matrices map onto the SIMD kernels.
+    void assign(const BinaryExpr<Matrix, Matrix, AddOp>& e) {
+        simd::kernels<T>().add(e.lhs().data(), e.rhs().data(), data(), storageSize());
+    }
+
+    void assign(const BinaryExpr<Matrix, Matrix, SubOp>& e) {
+        simd::kernels<T>().sub(e.lhs().data(), e.rhs().data(), data(), storageSize());
+    }
+
+    void assign(const ScaleExpr<Matrix>& e) {
+        simd::kernels<T>().scale(e.operand().data(), e.scalar(), data(), storageSize());
+    }
+
+    void assign(const TransposeExpr<Matrix>& e) {
+        const Matrix& m = e.operand();
+        detail::transposeBlock(m.rows_, m.cols_, m.data(), m.ld_, data(), ld_);
+    }
+
+    template<typename U>
+    friend void transpose_in_place(Matrix<U>& m);
+};
+
+template<typename E>
+ostream& operator<<(ostream& os, const MatrixExpr<E>& e) {
+    return os << Matrix<typename E::value_type>(e.self());
+}
+
+// Matrix product. Expression operands are evaluated first; plain matrices,
+// mapped matrices and views are read in place.
+template<typename T>
+MatrixView<const T> evaluate(const Matrix<T>& m) {
+    return m.view();
+}
+
+template<typename T>
+MatrixView<const T> evaluate(const MappedMatrix<T>& m) {
+    return m.view();
+}
+
+template<typename T>
+MatrixView<const remove_const_t<T>> evaluate(MatrixView<T> v) {
+    return v;
+}
+
+template<typename E>
+Matrix<typename E::value_type> evaluate(const MatrixExpr<E>& e) {
+    return Matrix<typename E::value_type>(e.self());
+}
+
+template<typename TA, typename TB>
+Matrix<remove_const_t<TA>> multiply(MatrixView<TA> a, MatrixView<TB> b, exec::sequential_policy);
+
+template<typename L, typename R>
+Matrix<typename L::value_type> operator*(const MatrixExpr<L>& a, const MatrixExpr<R>& b) {
+
+    static_assert(ExtentsMatch<StaticExtents<L>::cols, StaticExtents<R>::rows>::value,
+                  "Incompatible dimensions for multiplication");
+
+    const auto& lhs = evaluate(a.self());
+    const auto& rhs = evaluate(b.self());
+
+    return multiply(evaluate(lhs), evaluate(rhs), exec::seq);
+}
+
+namespace detail {
+
+template<typename T, int R, int C, int K, size_t... P>
+constexpr T fixedDot(const Matrix<T, R, C>& a, const Matrix<T, C, K>& b, int i, int j, index_sequence<P...>) {
+    return (T() + ... + (a.coeff(i, P) * b.coeff(P, j)));
+}
+
+template<typename T, int R, int C, int K, size_t... I>
+constexpr Matrix<T, R, K> fixedProduct(const Matrix<T, R, C>& a, const Matrix<T, C, K>& b, index_sequence<I...>) {
+    return Matrix<T, R, K>(fixedDot(a, b, I / K, I % K, make_index_sequence<C>{})...);
+}
+
+template<typename T, int R, int C, size_t... I>
+constexpr Matrix<T, C, R> fixedTranspose(const Matrix<T, R, C>& m, index_sequence<I...>) {
+    return Matrix<T, C, R>(m.coeff(I % R, I / R)...);
+}
+
+template<typename T, int R, int C, typename Op, size_t... I>
+constexpr Matrix<T, R, C> fixedElementwise(const Matrix<T, R, C>& a, const Matrix<T, R, C>& b, Op op, index_sequence<I...>) {
+    return Matrix<T, R, C>(op(a.coeff(I), b.coeff(I))...);
+}
+
+template<typename T, int N, size_t... I>
+constexpr T fixedTrace(const Matrix<T, N, N>& m, index_sequence<I...>) {
+    return (T() + ... + m.coeff(I, I));
+}
+
+} // namespace detail
+
+// Fixed-extent matrix for small transforms. Elements live inline, every
+// operation is constexpr and unrolled through index sequences, and extents
+// are part of the type, so mismatched shapes do not compile. Mixing with a
+// dynamic Matrix<T> goes through the expression operators and yields a
+// dynamic result.
+template<typename T, int R, int C>
+class Matrix : public MatrixExpr<Matrix<T, R, C>> {
+public:
+    using value_type = T;
+    static constexpr bool elementwise = false;
+
+    static_assert(R > 0 && C > 0, "Fixed Matrix extents must be positive");
+
+    constexpr Matrix()
+        : data_{} {}
+
+    // Row-major element list; the count must match R * C exactly.
+    template<typename... Args,
+             typename = enable_if_t<sizeof...(Args) == R * C && conjunction<is_convertible<Args, T>...>::value>>
+    constexpr Matrix(Args... values)
+        : data_{ static_cast<T>(values)... } {}
+
+    explicit Matrix(const Matrix<T>& m)
+        : data_{}
+    {
+        if (m.rows() != R || m.cols() != C) {
+            cerr << "Error: Incompatible dimensions for conversion\n";
+            return;
+        }
+
+        for (int i = 0; i < R; ++i)
+            for (int j = 0; j < C; ++j)
+                data_[i * C + j] = m.coeff(i, j);
+    }
+
+    constexpr T& operator()(int i, int j) {
+        assert(i >= 0 && i < R && j >= 0 && j < C);
+        return data_[i * C + j];
+    }
+
+    constexpr const T& operator()(int i, int j) const {
+        assert(i >= 0 && i < R && j >= 0 && j < C);
+        return data_[i * C + j];
+    }
+
+    static constexpr int rows() noexcept {
+        return R;
+    }
+
+    static constexpr int cols() noexcept {
+        return C;
+    }
+
+    static constexpr size_t size() noexcept {
+        return static_cast<size_t>(R) * C;
+    }
+
+    constexpr T* data() noexcept {
+        return data_.data();
+    }
+
+    constexpr const T* data() const noexcept {
+        return data_.data();
+    }
+
+    constexpr const T& coeff(int i, int j) const noexcept {
+        return data_[i * C + j];
+    }
+
+    constexpr const T& coeff(size_t idx) const noexcept {
+        return data_[idx];
+    }
+
+    friend constexpr Matrix operator+(const Matrix& a, const Matrix& b) {
+        return detail::fixedElementwise(a, b, [](const T& x, const T& y) { return x + y; },
+                                        make_index_sequence<R * C>{});
+    }
+
+    friend constexpr Matrix operator-(const Matrix& a, const Matrix& b) {
+        return detail::fixedElementwise(a, b, [](const T& x, const T& y) { return x - y; },
+                                        make_index_sequence<R * C>{});
+    }
+
+    friend constexpr Matrix operator*(const Matrix& a, const T& s) {
+        return detail::fixedElementwise(a, a, [s](const T& x, const T&) { return x * s; },
+                                        make_index_sequence<R * C>{});
+    }
+
+    friend constexpr Matrix operator*(const T& s, const Matrix& a) {
+        return a * s;
+    }
+
+private:
+    array<T, R * C> data_;
+};
+
+template<typename T, int R, int C, int K, typename = enable_if_t<(R > 0 && C > 0 && K > 0)>>
+constexpr Matrix<T, R, K> operator*(const Matrix<T, R, C>& a, const Matrix<T, C, K>& b) {
+    return detail::fixedProduct(a, b, make_index_sequence<R * K>{});
+}
+
+template<typename T, int R, int C, typename = enable_if_t<(R > 0 && C > 0)>>
+constexpr Matrix<T, C, R> transpose(const Matrix<T, R, C>& m) {
+    return detail::fixedTranspose(m, make_index_sequence<R * C>{});
+}
+
+template<typename T, int R, int C, typename = enable_if_t<(R > 0 && C > 0)>>
+constexpr T trace(const Matrix<T, R, C>& m) {
+    static_assert(R == C, "Trace only defined for square matrices");
+    return detail::fixedTrace(m, make_index_sequence<R>{});
+}
+
+template<typename T>
+Matrix<T> transpose(const Matrix<T>& m) {
+
+    Matrix<T> result(m.cols(), m.rows(), uninitialized);
+    detail::transposeBlock(m.rows(), m.cols(), m.data(), m.ld(), result.data(), result.ld());
+
+    return result;
+}
+
+// Transposes m without a second buffer: square matrices swap blocks
+// recursively, rectangular ones pack their rows together, follow the
+// permutation cycles and spread the rows back out to the new padded stride.
+// The only allocation is the cycle bitset, unless the padded transpose needs
+// more room than the buffer has: then the buffer grows once, and transposing
+// straight into the new one costs no more than doing it in place. The grown
+// buffer also fits the transpose back.
+template<typename T>
+void transpose_in_place(Matrix<T>& m) {
+
+    if (m.rows_ == m.cols_) {
+        detail::transposeSquare(m.rows_, m.data(), m.ld_);
+        return;
+    }
+
+    int rows = m.rows_, cols = m.cols_;
+    int ld = m.ld_, newLd = Matrix<T>::paddedStride(rows);
+
+    if (static_cast<size_t>(cols) * newLd > m.data_.size()) {
+        detail::MatrixBuffer<T> grown(static_cast<size_t>(cols) * newLd, false, m.data_.resource());
+        detail::transposeBlock(rows, cols, m.data(), ld, grown.get(), newLd);
+        m.data_ = move(grown);
+        m.rows_ = cols;
+        m.cols_ = rows;
+        m.ld_ = newLd;
+        m.clearPadding();
+        return;
+    }
+
+    T* a = m.data();
+
+    for (int i = 1; i < rows; ++i)
+        move(a + static_cast<size_t>(i) * ld, a + static_cast<size_t>(i) * ld + cols,
+             a + static_cast<size_t>(i) * cols);
+
+    detail::transposeCycles(rows, cols, a);
+
+    for (int i = cols - 1; i > 0; --i)
+        move_backward(a + static_cast<size_t>(i) * rows, a + static_cast<size_t>(i + 1) * rows,
+                      a + static_cast<size_t>(i) * newLd + rows);
+
+    m.rows_ = cols;
+    m.cols_ = rows;
+    m.ld_ = newLd;
+    m.clearPadding();
+}
+
+template<typename T>
+Matrix<remove_const_t<T>> transpose(MatrixView<T> m) {
+
+    if (m.colStride() != 1)
+        return Matrix<remove_const_t<T>>(transpose_view(m));
+
+    Matrix<remove_const_t<T>> result(m.cols(), m.rows(), uninitialized);
+    detail::transposeBlock(m.rows(), m.cols(), m.data(), m.rowStride(), result.data(), result.ld());
+
+    return result;
+}
+
+template<typename T>
+remove_const_t<T> trace(MatrixView<T> m) {
+
+    if (m.rows() != m.cols()) {
+        cerr << "Error: Trace only defined for square matrices\n";
+        return remove_const_t<T>();
+    }
+
+    remove_const_t<T> sum = remove_const_t<T>();
+    for (int i = 0; i < m.rows(); ++i)
+        sum += m.coeff(i, i);
+
+    return sum;
+}
+
+template<typename T>
+T trace(const Matrix<T>& m) {
+
+    if (m.rows() != m.cols()) {
+        cerr << "Error: Trace only defined for square matrices\n";
+        return T();
+    }
+
+    T sum = T();
+    for (int i = 0; i < m.rows(); ++i)
+        sum += m(i, i);
+
+    return sum;
+}
+
+// The product of two views, read in place through their strides.
+template<typename TA, typename TB>
+Matrix<remove_const_t<TA>> multiply(MatrixView<TA> a, MatrixView<TB> b, exec::sequential_policy) {
+
+    using T = remove_const_t<TA>;
+
+    if (a.cols() != b.rows()) {
+        cerr << "Error: Incompatible dimensions for multiplication\n";
+        return Matrix<T>(0, 0);
+    }
+
+    Matrix<T> result(a.rows(), b.cols());
+    gemm(T(1), a, b, T(1), result.view());
+
+    return result;
+}
+
+template<typename T>
+Matrix<T> multiply(const Matrix<T>& a, const Matrix<T>& b, exec::sequential_policy) {
+    return multiply(a.view(), b.view(), exec::seq);
+}
+
+// BLAS-style routines that write into a caller-owned destination. Together
+// with the compound operators they let iterative code run without allocating.
+
+// C = alpha * A * B + beta * C on views. C must not overlap A or B; with
+// beta == 0 the previous contents of C are ignored. A and B may have any
+// strides; C is written with the blocked kernel when either of its strides
+// is 1 (a transposed C is handled as C^T = B^T * A^T).
+template<typename TA, typename TB, typename T>
+void gemm(const T& alpha, MatrixView<TA> a, MatrixView<TB> b, const T& beta, MatrixView<T> c) {
+
+    static_assert(is_same<remove_const_t<TA>, T>::value && is_same<remove_const_t<TB>, T>::value,
+                  "Matrix operands must have the same element type");
+
+    if (a.cols() != b.rows() || c.rows() != a.rows() || c.cols() != b.cols()) {
+        cerr << "Error: Incompatible dimensions for multiplication\n";
+        return;
+    }
+
+    if (beta == T())
+        c.fill(T());
+    else if (beta != T(1))
+        c *= beta;
+
+    if (alpha == T())
+        return;
+
+    if (c.colStride() != 1 && c.rowStride() == 1) {
+        gemm(alpha, b.transposed(), a.transposed(), T(1), c.transposed());
+        return;
+    }
+
+    if (c.colStride() == 1
+        && static_cast<long long>(a.rows()) * a.cols() * b.cols() >= Matrix<T>::blockedThreshold) {
+        detail::gemmBlocked(a.rows(), b.cols(), a.cols(), alpha,
+                            a.data(), a.rowStride(), a.colStride(),
+                            b.data(), b.rowStride(), b.colStride(),
+                            c.data(), c.rowStride());
+        return;
+    }
+
+    for (int i = 0; i < a.rows(); ++i) {
+        for (int j = 0; j < b.cols(); ++j) {
+            T sum = T();
+            for (int k = 0; k < a.cols(); ++k)
+                sum += a.coeff(i, k) * b.coeff(k, j);
+            c.coeff(i, j) += alpha * sum;
+        }
+    }
+}
+
+template<typename T>
+void gemm(const T& alpha, const Matrix<T>& a, const Matrix<T>& b, const T& beta, Matrix<T>& c) {
+    gemm(alpha, a.view(), b.view(), beta, c.view());
+}
+
+// Y += alpha * X.
+template<typename T>
+void axpy(const T& alpha, const Matrix<T>& x, Matrix<T>& y) {
+    y += x * alpha;
+}
+
+// dst = transpose(src); dst must already be src.cols() x src.rows() and must
+// not overlap src.
+template<typename TS, typename T>
+void transpose_into(MatrixView<TS> src, MatrixView<T> dst) {
+
+    if (dst.rows() != src.cols() || dst.cols() != src.rows()) {
+        cerr << "Error: Incompatible dimensions for transpose\n";
+        return;
+    }
+
+    if (src.colStride() == 1 && dst.colStride() == 1)
+        detail::transposeBlock(src.rows(), src.cols(), src.data(), src.rowStride(), dst.data(), dst.rowStride());
+    else
+        dst = transpose_view(src);
+}
+
+template<typename T>
+void transpose_into(const Matrix<T>& src, Matrix<T>& dst) {
+    transpose_into(src.view(), dst.view());
+}
+
+// Strassen-Winograd product: 7 half-size products and 15 additions per level
+// instead of 8 products, recursing until a dimension drops to the crossover
+// and then handing the block to gemm(). Rounding error grows faster than with
+// the classical product (the bound picks up a factor that grows roughly as
+// n^log2(12) instead of n), so it is opt-in.
+namespace detail {
+
+// Below this many rows, columns or inner terms the blocked kernel wins.
+constexpr int strassenCrossover = 256;
+
+// c = a + b and c = a - b on views. Rows with unit column stride go through
+// the SIMD kernels; other layouts fall back to the element-wise expression.
+// c may be a or b, but must not otherwise overlap them.
+template<typename T>
+void viewAdd(MatrixView<const T> a, MatrixView<const T> b, MatrixView<T> c) {
+
+    if (a.colStride() != 1 || b.colStride() != 1 || c.colStride() != 1) {
+        c = a + b;
+        return;
+    }
+
+    auto add = simd::kernels<T>().add;
+    for (int i = 0; i < c.rows(); ++i)
+        add(&a.coeff(i, 0), &b.coeff(i, 0), &c.coeff(i, 0), static_cast<size_t>(c.cols()));
+}
+
+template<typename T>
+void viewSub(MatrixView<const T> a, MatrixView<const T> b, MatrixView<T> c) {
+
+    if (a.colStride() != 1 || b.colStride() != 1 || c.colStride() != 1) {
+        c = a - b;
+        return;
+    }
+
+    auto sub = simd::kernels<T>().sub;
+    for (int i = 0; i < c.rows(); ++i)
+        sub(&a.coeff(i, 0), &b.coeff(i, 0), &c.coeff(i, 0), static_cast<size_t>(c.cols()));
+}
+
+inline bool strassenLeaf(int m, int k, int n, int crossover) {
+    return m <= crossover || k <= crossover || n <= crossover;
+}
+
+// Scratch elements needed by strassenRecurse() for an m x k by k x n product:
+// the three temporaries of this level plus those of the deepest level below.
+inline size_t strassenWorkspace(int m, int k, int n, int crossover) {
+
+    if (strassenLeaf(m, k, n, crossover))
+        return 0;
+
+    int m2 = m / 2, k2 = k / 2, n2 = n / 2;
+    size_t level = static_cast<size_t>(m2) * k2 + static_cast<size_t>(k2) * n2 + static_cast<size_t>(m2) * n2;
+
+    return level + strassenWorkspace(m2, k2, n2, crossover);
+}
+
+// c = a * b. Each level uses the Douglas et al. schedule, which needs only
+// three temporaries (X = m/2 x k/2, Y = k/2 x n/2, Z = m/2 x n/2) carved from
+// the front of work; the quadrants of c hold the other partial products. Odd
+// trailing rows and columns are peeled off and finished with gemm().
+template<typename T>
+void strassenRecurse(MatrixView<const T> a, MatrixView<const T> b, MatrixView<T> c, T* work, int crossover) {
+
+    int m = a.rows(), k = a.cols(), n = b.cols();
+
+    if (strassenLeaf(m, k, n, crossover)) {
+        gemm(T(1), a, b, T(), c);
+        return;
+    }
+
+    int m2 = m / 2, k2 = k / 2, n2 = n / 2;
+
+    MatrixView<const T> a11 = a.block(0, 0, m2, k2), a12 = a.block(0, k2, m2, k2);
+    MatrixView<const T> a21 = a.block(m2, 0, m2, k2), a22 = a.block(m2, k2, m2, k2);
+    MatrixView<const T> b11 = b.block(0, 0, k2, n2), b12 = b.block(0, n2, k2, n2);
+    MatrixView<const T> b21 = b.block(k2, 0, k2, n2), b22 = b.block(k2, n2, k2, n2);
+    MatrixView<T> c11 = c.block(0, 0, m2, n2), c12 = c.block(0, n2, m2, n2);
+    MatrixView<T> c21 = c.block(m2, 0, m2, n2), c22 = c.block(m2, n2, m2, n2);
+
+    MatrixView<T> x(work, m2, k2, k2);
+    work += static_cast<size_t>(m2) * k2;
+    MatrixView<T> y(work, k2, n2, n2);
+    work += static_cast<size_t>(k2) * n2;
+    MatrixView<T> z(work, m2, n2, n2);
+    work += static_cast<size_t>(m2) * n2;
+
+    viewSub<T>(a11, a21, x);                             // S3
+    viewSub<T>(b22, b12, y);                             // T3
+    strassenRecurse<T>(x, y, c21, work, crossover);      // P7
+    viewAdd<T>(a21, a22, x);                             // S1
+    viewSub<T>(b12, b11, y);                             // T1
+    strassenRecurse<T>(x, y, c22, work, crossover);      // P5
+    viewSub<T>(x, a11, x);                               // S2
+    viewSub<T>(b22, y, y);                               // T2
+    strassenRecurse<T>(x, y, c12, work, crossover);      // P6
+    viewSub<T>(a12, x, x);                               // S4
+    strassenRecurse<T>(x, b22, c11, work, crossover);    // P3
+    strassenRecurse<T>(a11, b11, z, work, crossover);    // P1
+    viewAdd<T>(z, c12, c12);                             // U2 = P1 + P6
+    viewAdd<T>(c12, c21, c21);                           // U3 = U2 + P7
+    viewAdd<T>(c12, c22, c12);                           // U4 = U2 + P5
+    viewAdd<T>(c21, c22, c22);                           // U7 = U3 + P5
+    viewAdd<T>(c12, c11, c12);                           // U5 = U4 + P3
+    viewSub<T>(y, b21, y);                               // T4
+    strassenRecurse<T>(a22, y, c11, work, crossover);    // P4
+    viewSub<T>(c21, c11, c21);                           // U6 = U3 - P4
+    strassenRecurse<T>(a12, b21, c11, work, crossover);  // P2
+    viewAdd<T>(c11, z, c11);                             // U1 = P1 + P2
+
+    int me = 2 * m2, ke = 2 * k2, ne = 2 * n2;
+
+    if (k != ke)
+        gemm(T(1), a.block(0, ke, me, 1), b.block(ke, 0, 1, ne), T(1), c.block(0, 0, me, ne));
+    if (n != ne)
+        gemm(T(1), a, b.block(0, ne, k, 1), T(), c.block(0, ne, m, 1));
+    if (m != me)
+        gemm(T(1), a.block(me, 0, 1, k), b.block(0, 0, k, ne), T(), c.block(me, 0, 1, ne));
+}
+
+} // namespace detail
+
+// Opt-in Strassen-Winograd product. Worthwhile for large, roughly square
+// floating-point products; crossover is the size at which the recursion
+// switches to the blocked kernel. All scratch memory is allocated once, up
+// front, and shared by every recursion level.
+template<typename TA, typename TB>
+Matrix<remove_const_t<TA>> multiply_strassen(MatrixView<TA> a, MatrixView<TB> b,
+                                             int crossover = detail::strassenCrossover) {
+
+    using T = remove_const_t<TA>;
+    static_assert(is_same<remove_const_t<TB>, T>::value, "Matrix operands must have the same element type");
+
+    if (a.cols() != b.rows()) {
+        cerr << "Error: Incompatible dimensions for multiplication\n";
+        return Matrix<T>(0, 0);
+    }
+
+    Matrix<T> result(a.rows(), b.cols(), uninitialized);
+    crossover = max(crossover, 1);
+
+    vector<T> work(detail::strassenWorkspace(a.rows(), a.cols(), b.cols(), crossover));
+    detail::strassenRecurse<T>(a, b, result.view(), work.data(), crossover);
+
+    return result;
+}
+
+template<typename T>
+Matrix<T> multiply_strassen(const Matrix<T>& a, const Matrix<T>& b, int crossover = detail::strassenCrossover) {
+    return multiply_strassen(a.view(), b.view(), crossover);
+}
+
+// Matrix-chain products. A chain of n factors is described by n + 1
+// dimensions: factor i is dims[i] x dims[i + 1]. plan_chain() runs the
+// classic O(n^3) dynamic program for the parenthesization with the fewest
+// multiply-adds; multiply_chain() executes that plan.
+struct ChainPlan {
+    vector<int> dims;
+    vector<int> split;          // split[i * n + j]: last factor of the left operand of i..j
+    long long flops = 0;        // estimated FLOPs (2 per multiply-add) of the chosen order
+    long long naiveFlops = 0;   // the same for left-to-right evaluation
+
+    int factors() const noexcept {
+        return static_cast<int>(dims.size()) - 1;
+    }
+
+    int splitAt(int i, int j) const noexcept {
+        return split[static_cast<size_t>(i) * factors() + j];
+    }
+
+    // The chosen order with factors named A0, A1, ..., e.g. "(A0 * (A1 * A2))".
+    string order() const {
+        return factors() > 0 ? order(0, factors() - 1) : string();
+    }
+
+private:
+    string order(int i, int j) const {
+
+        if (i == j)
+            return "A" + to_string(i);
+
+        int k = splitAt(i, j);
+        return "(" + order(i, k) + " * " + order(k + 1, j) + ")";
+    }
+};
+
+inline ostream& operator<<(ostream& os, const ChainPlan& plan) {
+    return os << plan.order() << ": " << plan.flops << " flops (left to right: " << plan.naiveFlops << ")";
+}
+
+inline ChainPlan plan_chain(const vector<int>& dims) {
+
+    ChainPlan plan;
+    plan.dims = dims;
+
+    int n = plan.factors();
+    if (n <= 0)
+        return plan;
+
+    auto product = [&](int i, int k, int j) {
+        return 2LL * dims[i] * dims[k + 1] * dims[j + 1];
+    };
+
+    vector<long long> cost(static_cast<size_t>(n) * n, 0);
+    plan.split.assign(static_cast<size_t>(n) * n, 0);
+
+    for (int len = 2; len <= n; ++len) {
+        for (int i = 0; i + len - 1 < n; ++i) {
+            int j = i + len - 1;
+            long long best = numeric_limits<long long>::max();
+            for (int k = i; k < j; ++k) {
+                long long c = cost[static_cast<size_t>(i) * n + k] + cost[static_cast<size_t>(k + 1) * n + j]
+                              + product(i, k, j);
+                if (c < best) {
+                    best = c;
+                    plan.split[static_cast<size_t>(i) * n + j] = k;
+                }
+            }
+            cost[static_cast<size_t>(i) * n + j] = best;
+        }
+    }
+
+    plan.flops = cost[n - 1];
+    for (int k = 1; k < n; ++k)
+        plan.naiveFlops += product(0, k - 1, k);
+
+    return plan;
+}
+
+namespace detail {
+
+// Runs a ChainPlan bottom-up. Intermediate products live in scratch buffers
+// that are handed back to a free list as soon as their parent has consumed
+// them, so a chain needs at most a few buffers however long it is.
+template<typename T>
+class ChainEvaluator {
+public:
+    ChainEvaluator(const vector<const Matrix<T>*>& factors, const ChainPlan& plan)
+        : factors_(factors), plan_(plan) {}
+
+    Matrix<T> run() {
+
+        int n = plan_.factors();
+        Matrix<T> result(plan_.dims[0], plan_.dims[n], uninitialized);
+
+        if (n == 1) {
+            result = *factors_[0];
+            return result;
+        }
+
+        int k = plan_.splitAt(0, n - 1);
+        Operand left = evaluate(0, k), right = evaluate(k + 1, n - 1);
+        gemm(T(1), left.view, right.view, T(), result.view());
+
+        return result;
+    }
+
+private:
+    struct Operand {
+        MatrixView<const T> view;
+        int buffer;
+    };
+
+    const vector<const Matrix<T>*>& factors_;
+    const ChainPlan& plan_;
+    vector<vector<T>> buffers_;
+    vector<bool> busy_;
+
+    Operand evaluate(int i, int j) {
+
+        if (i == j)
+            return { factors_[i]->view(), -1 };
+
+        int k = plan_.splitAt(i, j);
+        Operand left = evaluate(i, k), right = evaluate(k + 1, j);
+
+        int rows = plan_.dims[i], cols = plan_.dims[j + 1];
+        int buffer = acquire(static_cast<size_t>(rows) * cols);
+        MatrixView<T> out(buffers_[buffer].data(), rows, cols, cols);
+        gemm(T(1), left.view, right.view, T(), out);
+
+        release(left.buffer);
+        release(right.buffer);
+
+        return { out, buffer };
+    }
+
+    // Best fit among the free buffers; the largest free one is grown when
+    // none is big enough.
+    int acquire(size_t size) {
+
+        int best = -1, largest = -1;
+        for (size_t b = 0; b < buffers_.size(); ++b) {
+            if (busy_[b])
+                continue;
+            size_t have = buffers_[b].size();
+            if (have >= size && (best < 0 || have < buffers_[best].size()))
+                best = static_cast<int>(b);
+            if (largest < 0 || have > buffers_[largest].size())
+                largest = static_cast<int>(b);
+        }
+
+        if (best < 0) {
+            if (largest < 0) {
+                largest = static_cast<int>(buffers_.size());
+                buffers_.emplace_back();
+                busy_.push_back(false);
+            }
+            buffers_[largest].resize(size);
+            best = largest;
+        }
+
+        busy_[best] = true;
+        return best;
+    }
+
+    void release(int buffer) {
+        if (buffer >= 0)
+            busy_[buffer] = false;
+    }
+};
+
+} // namespace detail
+
+// Product of the factors in the cheapest order; the plan that was used is
+// stored in *plan when one is given.
+template<typename T>
+Matrix<T> multiply_chain(const vector<const Matrix<T>*>& factors, ChainPlan* plan = nullptr) {
+
+    if (factors.empty()) {
+        cerr << "Error: Empty matrix chain\n";
+        return Matrix<T>(0, 0);
+    }
+
+    vector<int> dims{ factors[0]->rows() };
+    for (size_t i = 0; i < factors.size(); ++i) {
+        if (factors[i]->rows() != dims.back()) {
+            cerr << "Error: Incompatible dimensions for multiplication\n";
+            return Matrix<T>(0, 0);
+        }
+        dims.push_back(factors[i]->cols());
+    }
+
+    ChainPlan chosen = plan_chain(dims);
+    Matrix<T> result = detail::ChainEvaluator<T>(factors, chosen).run();
+
+    if (plan)
+        *plan = move(chosen);
+
+    return result;
+}
+
+template<typename T, typename... Rest>
+Matrix<T> multiply_chain(const Matrix<T>& first, const Rest&... rest) {
+
+    static_assert(conjunction<is_same<Rest, Matrix<T>>...>::value,
+                  "Matrix chain factors must have the same element type");
+
+    return multiply_chain(vector<const Matrix<T>*>{ &first, &rest... });
+}
+
+template<typename T, typename... Rest>
+ChainPlan plan_chain(const Matrix<T>& first, const Rest&... rest) {
+    return plan_chain(vector<int>{ first.rows(), first.cols(), rest.cols()... });
+}
+
+// C is split into MC-row tiles, and into column tiles as well when there are
+// too few rows to keep every thread busy; each task runs the blocked kernel
+// on its own tile.
+template<typename TA, typename TB>
+Matrix<remove_const_t<TA>> multiply(MatrixView<TA> a, MatrixView<TB> b, exec::parallel_policy) {
+
+    using T = remove_const_t<TA>;
+
+    if (a.cols() != b.rows()) {
+        cerr << "Error: Incompatible dimensions for multiplication\n";
+        return Matrix<T>(0, 0);
+    }
+
+    int m = a.rows(), n = b.cols(), k = a.cols();
+    ThreadPool& pool = ThreadPool::global();
+
+    if (static_cast<long long>(m) * n * k < exec::parallelGemmThreshold || pool.threadCount() == 1)
+        return multiply(a, b, exec::seq);
+
+    Matrix<T> result(m, n);
+
+    int tileM = detail::gemmMC;
+    int rowTiles = (m + tileM - 1) / tileM;
+    int colSplit = max(1, static_cast<int>(pool.threadCount()) / rowTiles);
+    int tileN = (n + colSplit - 1) / colSplit;
+    tileN = (tileN + detail::gemmNR - 1) / detail::gemmNR * detail::gemmNR;
+    int colTiles = (n + tileN - 1) / tileN;
+
+    pool.parallelFor(static_cast<size_t>(rowTiles) * colTiles, [&](size_t task) {
+        int i0 = static_cast<int>(task / colTiles) * tileM;
+        int j0 = static_cast<int>(task % colTiles) * tileN;
+        int h = min(tileM, m - i0), w = min(tileN, n - j0);
+        gemm(T(1), a.block(i0, 0, h, k), b.block(0, j0, k, w), T(1), result.block(i0, j0, h, w));
+    });
+
+    return result;
+}
+
+template<typename T>
+Matrix<T> multiply(const Matrix<T>& a, const Matrix<T>& b, exec::parallel_policy) {
+    return multiply(a.view(), b.view(), exec::parallel);
+}
+
+namespace detail {
+
+// Runs kernel(a, b, out, count) over [0, n) in fixed-size chunks on the pool.
+template<typename T, typename Kernel>
+void parallelElementwise(const T* a, const T* b, T* out, size_t n, Kernel kernel) {
+
+    ThreadPool& pool = ThreadPool::global();
+
+    if (n < exec::parallelElementThreshold || pool.threadCount() == 1) {
+        kernel(a, b, out, n);
+        return;
+    }
+
+    size_t chunks = (n + exec::elementChunk - 1) / exec::elementChunk;
+    pool.parallelFor(chunks, [&](size_t c) {
+        size_t begin = c * exec::elementChunk;
+        kernel(a + begin, b + begin, out + begin, min(exec::elementChunk, n - begin));
+    });
+}
+
+} // namespace detail
+
+template<typename T>
+Matrix<T> add(const Matrix<T>& a, const Matrix<T>& b, exec::sequential_policy) {
+    return a + b;
+}
+
+template<typename T>
+Matrix<T> add(const Matrix<T>& a, const Matrix<T>& b, exec::parallel_policy) {
+
+    if (a.rows() != b.rows() || a.cols() != b.cols()) {
+        cerr << "Error: Incompatible dimensions for addition\n";
+        return Matrix<T>(0, 0);
+    }
+
+    Matrix<T> result(a.rows(), a.cols(), uninitialized);
+    detail::parallelElementwise(a.data(), b.data(), result.data(), a.storageSize(), simd::kernels<T>().add);
+
+    return result;
+}
+
+template<typename T>
+Matrix<T> subtract(const Matrix<T>& a, const Matrix<T>& b, exec::sequential_policy) {
+    return a - b;
+}
+
+template<typename T>
+Matrix<T> subtract(const Matrix<T>& a, const Matrix<T>& b, exec::parallel_policy) {
+
+    if (a.rows() != b.rows() || a.cols() != b.cols()) {
+        cerr << "Error: Incompatible dimensions for subtraction\n";
+        return Matrix<T>(0, 0);
+    }
+
+    Matrix<T> result(a.rows(), a.cols(), uninitialized);
+    detail::parallelElementwise(a.data(), b.data(), result.data(), a.storageSize(), simd::kernels<T>().sub);
+
+    return result;
+}
+
+namespace detail {
+
+// c = a op b on views, split into bands of rows on the pool when parallel.
+template<typename T, typename Op>
+Matrix<T> viewElementwise(MatrixView<const T> a, MatrixView<const T> b, bool parallel, Op op, const char* what) {
+
+    if (a.rows() != b.rows() || a.cols() != b.cols()) {
+        cerr << "Error: Incompatible dimensions for " << what << "\n";
+        return Matrix<T>(0, 0);
+    }
+
+    Matrix<T> result(a.rows(), a.cols(), uninitialized);
+    ThreadPool& pool = ThreadPool::global();
+    size_t elements = static_cast<size_t>(a.rows()) * a.cols();
+
+    if (!parallel || elements < exec::parallelElementThreshold || pool.threadCount() == 1) {
+        op(a, b, result.view());
+        return result;
+    }
+
+    int band = max(1, static_cast<int>(exec::elementChunk / max<size_t>(a.cols(), 1)));
+    int rows = a.rows(), cols = a.cols();
+    pool.parallelFor(static_cast<size_t>((rows + band - 1) / band), [&](size_t task) {
+        int i0 = static_cast<int>(task) * band, h = min(band, rows - i0);
+        op(a.block(i0, 0, h, cols), b.block(i0, 0, h, cols), result.block(i0, 0, h, cols));
+    });
+
+    return result;
+}
+
+} // namespace detail
+
+template<typename TA, typename TB, typename Policy,
+         typename = enable_if_t<is_same<Policy, exec::sequential_policy>::value
+                                || is_same<Policy, exec::parallel_policy>::value>>
+Matrix<remove_const_t<TA>> add(MatrixView<TA> a, MatrixView<TB> b, Policy) {
+
+    using T = remove_const_t<TA>;
+    return detail::viewElementwise<T>(a, b, is_same<Policy, exec::parallel_policy>::value,
+                                      detail::viewAdd<T>, "addition");
+}
+
+template<typename TA, typename TB, typename Policy,
+         typename = enable_if_t<is_same<Policy, exec::sequential_policy>::value
+                                || is_same<Policy, exec::parallel_policy>::value>>
+Matrix<remove_const_t<TA>> subtract(MatrixView<TA> a, MatrixView<TB> b, Policy) {
+
+    using T = remove_const_t<TA>;
+    return detail::viewElementwise<T>(a, b, is_same<Policy, exec::parallel_policy>::value,
+                                      detail::viewSub<T>, "subtraction");
+}
+
+template<typename T>
+Matrix<T> transpose(const Matrix<T>& m, exec::sequential_policy) {
+    return transpose(m);
+}
+
+// Each task transposes a band of source rows into the matching result columns.
+template<typename T>
+Matrix<T> transpose(const Matrix<T>& m, exec::parallel_policy) {
+
+    ThreadPool& pool = ThreadPool::global();
+
+    if (m.size() < exec::parallelElementThreshold || pool.threadCount() == 1)
+        return transpose(m);
+
+    Matrix<T> result(m.cols(), m.rows(), uninitialized);
+
+    const int band = 64;
+    int rows = m.rows(), cols = m.cols();
+    int lds = m.ld(), ldd = result.ld();
+    const T* src = m.data();
+    T* dst = result.data();
+
+    pool.parallelFor(static_cast<size_t>((rows + band - 1) / band), [&](size_t task) {
+        int i0 = static_cast<int>(task) * band;
+        detail::transposeBlock(min(band, rows - i0), cols,
+                               src + static_cast<size_t>(i0) * lds, lds, dst + i0, ldd);
+    });
+
+    return result;
+}
+
+// Compressed sparse row matrix for mostly-zero data. Storage is O(nnz) and
+// every product only visits stored entries. The free transpose() returns the
+// CSR form of the transpose, which is the CSC layout of the original, so
+// column-oriented access needs no separate type.
+template<typename T>
+class SparseMatrix {
+public:
+
+    SparseMatrix(int rows, int cols)
+        : rows_(rows), cols_(cols), rowPtr_(static_cast<size_t>(rows) + 1, 0) {}
+
+    // Keeps every element that differs from T().
+    explicit SparseMatrix(const Matrix<T>& m)
+        : rows_(m.rows()), cols_(m.cols()), rowPtr_(static_cast<size_t>(m.rows()) + 1, 0)
+    {
+        for (int i = 0; i < rows_; ++i) {
+            for (int j = 0; j < cols_; ++j) {
+                const T& v = m.coeff(i, j);
+                if (v != T()) {
+                    colIdx_.push_back(j);
+                    values_.push_back(v);
+                }
+            }
+            rowPtr_[i + 1] = static_cast<int>(values_.size());
+        }
+    }
+
+    // Builds from raw CSR arrays; column indices must be sorted within each row.
+    SparseMatrix(int rows, int cols, vector<int> rowPtr, vector<int> colIdx, vector<T> values)
+        : rows_(rows), cols_(cols), rowPtr_(move(rowPtr)), colIdx_(move(colIdx)), values_(move(values)) {}
+
+    int rows() const noexcept {
+        return rows_;
+    }
+
+    int cols() const noexcept {
+        return cols_;
+    }
+
+    size_t nonZeros() const noexcept {
+        return values_.size();
+    }
+
+    const vector<int>& rowPtr() const noexcept {
+        return rowPtr_;
+    }
+
+    const vector<int>& colIdx() const noexcept {
+        return colIdx_;
+    }
+
+    const vector<T>& values() const noexcept {
+        return values_;
+    }
+
+    // Element lookup by binary search within the row; absent entries are T().
+    T operator()(int i, int j) const {
+
+        if (i < 0 || i >= rows_ || j < 0 || j >= cols_) {
+            cerr << "Error: Index out of bounds\n";
+            return T();
+        }
+
+        auto first = colIdx_.begin() + rowPtr_[i];
+        auto last = colIdx_.begin() + rowPtr_[i + 1];
+        auto it = lower_bound(first, last, j);
+
+        return (it != last && *it == j) ? values_[it - colIdx_.begin()] : T();
+    }
+
+    Matrix<T> toDense() const {
+
+        Matrix<T> result(rows_, cols_);
+
+        for (int i = 0; i < rows_; ++i)
+            for (int p = rowPtr_[i]; p < rowPtr_[i + 1]; ++p)
+                result(i, colIdx_[p]) = values_[p];
+
+        return result;
+    }
+
+    friend ostream& operator<<(ostream& os, const SparseMatrix& m) {
+        return os << m.toDense();
+    }
+
+    friend SparseMatrix operator+(const SparseMatrix& a, const SparseMatrix& b) {
+        return merge(a, b, AddOp(), "addition");
+    }
+
+    friend SparseMatrix operator-(const SparseMatrix& a, const SparseMatrix& b) {
+        return merge(a, b, SubOp(), "subtraction");
+    }
+
+    // SpMV: y = A * x.
+    friend vector<T> operator*(const SparseMatrix& a, const vector<T>& x) {
+
+        if (static_cast<size_t>(a.cols_) != x.size()) {
+            cerr << "Error: Incompatible dimensions for multiplication\n";
+            return vector<T>();
+        }
+
+        vector<T> y(a.rows_);
+
+        for (int i = 0; i < a.rows_; ++i) {
+            T sum = T();
+            for (int p = a.rowPtr_[i]; p < a.rowPtr_[i + 1]; ++p)
+                sum += a.values_[p] * x[a.colIdx_[p]];
+            y[i] = sum;
+        }
+
+        return y;
+    }
+
+    // Sparse x dense: each stored a(i, k) adds a scaled row k of B to row i of C.
+    friend Matrix<T> operator*(const SparseMatrix& a, const Matrix<T>& b) {
+
+        if (a.cols_ != b.rows()) {
+            cerr << "Error: Incompatible dimensions for multiplication\n";
+            return Matrix<T>(0, 0);
+        }
+
+        Matrix<T> result(a.rows_, b.cols());
+        int n = b.cols();
+
+        for (int i = 0; i < a.rows_; ++i) {
+            T* c = result.data() + static_cast<size_t>(i) * result.ld();
+            for (int p = a.rowPtr_[i]; p < a.rowPtr_[i + 1]; ++p) {
+                const T v = a.values_[p];
+                const T* row = b.data() + static_cast<size_t>(a.colIdx_[p]) * b.ld();
+                for (int j = 0; j < n; ++j)
+                    c[j] += v * row[j];
+            }
+        }
+
+        return result;
+    }
+
+    // Dense x sparse: row i of C accumulates a(i, k) times stored row k of S.
+    friend Matrix<T> operator*(const Matrix<T>& a, const SparseMatrix& b) {
+
+        if (a.cols() != b.rows_) {
+            cerr << "Error: Incompatible dimensions for multiplication\n";
+            return Matrix<T>(0, 0);
+        }
+
+        Matrix<T> result(a.rows(), b.cols_);
+
+        for (int i = 0; i < a.rows(); ++i) {
+            T* c = result.data() + static_cast<size_t>(i) * result.ld();
+            for (int k = 0; k < a.cols(); ++k) {
+                const T v = a.coeff(i, k);
+                if (v == T())
+                    continue;
+                for (int p = b.rowPtr_[k]; p < b.rowPtr_[k + 1]; ++p)
+                    c[b.colIdx_[p]] += v * b.values_[p];
+            }
+        }
+
+        return result;
+    }
+
+    // Sparse x sparse (Gustavson): one dense accumulator row plus a marker
+    // array, reused across rows; column indices are sorted on output.
+    friend SparseMatrix operator*(const SparseMatrix& a, const SparseMatrix& b) {
+
+        if (a.cols_ != b.rows_) {
+            cerr << "Error: Incompatible dimensions for multiplication\n";
+            return SparseMatrix(0, 0);
+        }
+
+        SparseMatrix result(a.rows_, b.cols_);
+        vector<T> acc(b.cols_);
+        vector<int> marker(b.cols_, -1);
+        vector<int> touched;
+
+        for (int i = 0; i < a.rows_; ++i) {
+            touched.clear();
+
+            for (int p = a.rowPtr_[i]; p < a.rowPtr_[i + 1]; ++p) {
+                const T v = a.values_[p];
+                int k = a.colIdx_[p];
+                for (int q = b.rowPtr_[k]; q < b.rowPtr_[k + 1]; ++q) {
+                    int j = b.colIdx_[q];
+                    if (marker[j] != i) {
+                        marker[j] = i;
+                        acc[j] = T();
+                        touched.push_back(j);
+                    }
+                    acc[j] += v * b.values_[q];
+                }
+            }
+
+            sort(touched.begin(), touched.end());
+            for (int j : touched) {
+                if (acc[j] != T()) {
+                    result.colIdx_.push_back(j);
+                    result.values_.push_back(acc[j]);
+                }
+            }
+            result.rowPtr_[i + 1] = static_cast<int>(result.values_.size());
+        }
+
+        return result;
+    }
+
+private:
+    int rows_, cols_;
+    vector<int> rowPtr_;
+    vector<int> colIdx_;
+    vector<T> values_;
+
+    // Row-by-row merge of two sorted index lists.
+    template<typename Op>
+    static SparseMatrix merge(const SparseMatrix& a, const SparseMatrix& b, Op, const char* what) {
+
+        if (a.rows_ != b.rows_ || a.cols_ != b.cols_) {
+            cerr << "Error: Incompatible dimensions for " << what << "\n";
+            return SparseMatrix(0, 0);
+        }
+
+        SparseMatrix result(a.rows_, a.cols_);
+        result.colIdx_.reserve(a.nonZeros() + b.nonZeros());
+        result.values_.reserve(a.nonZeros() + b.nonZeros());
+
+        for (int i = 0; i < a.rows_; ++i) {
+            int p = a.rowPtr_[i], pe = a.rowPtr_[i + 1];
+            int q = b.rowPtr_[i], qe = b.rowPtr_[i + 1];
+
+            while (p < pe || q < qe) {
+                int j;
+                T v;
+                if (q >= qe || (p < pe && a.colIdx_[p] < b.colIdx_[q])) {
+                    j = a.colIdx_[p];
+                    v = Op::apply(a.values_[p++], T());
+                } else if (p >= pe || b.colIdx_[q] < a.colIdx_[p]) {
+                    j = b.colIdx_[q];
+                    v = Op::apply(T(), b.values_[q++]);
+                } else {
+                    j = a.colIdx_[p];
+                    v = Op::apply(a.values_[p++], b.values_[q++]);
+                }
+
+                if (v != T()) {
+                    result.colIdx_.push_back(j);
+                    result.values_.push_back(v);
+                }
+            }
+            result.rowPtr_[i + 1] = static_cast<int>(result.values_.size());
+        }
+
+        return result;
+    }
+};
+
+// CSR of the transpose by a counting sort over column indices.
+template<typename T>
+SparseMatrix<T> transpose(const SparseMatrix<T>& m) {
+
+    const vector<int>& rowPtr = m.rowPtr();
+    const vector<int>& colIdx = m.colIdx();
+    const vector<T>& values = m.values();
+
+    vector<int> ptr(static_cast<size_t>(m.cols()) + 1, 0);
+    for (int j : colIdx)
+        ++ptr[j + 1];
+    for (int j = 0; j < m.cols(); ++j)
+        ptr[j + 1] += ptr[j];
+
+    vector<int> idx(colIdx.size());
+    vector<T> vals(values.size());
+    vector<int> next(ptr.begin(), ptr.end() - 1);
+
+    for (int i = 0; i < m.rows(); ++i) {
+        for (int p = rowPtr[i]; p < rowPtr[i + 1]; ++p) {
+            int dst = next[colIdx[p]]++;
+            idx[dst] = i;
+            vals[dst] = values[p];
+        }
+    }
+
+    return SparseMatrix<T>(m.cols(), m.rows(), move(ptr), move(idx), move(vals));
+}
+
+template<typename T>
+T trace(const SparseMatrix<T>& m) {
+
+    if (m.rows() != m.cols()) {
+        cerr << "Error: Trace only defined for square matrices\n";
+        return T();
+    }
+
+    T sum = T();
+    for (int i = 0; i < m.rows(); ++i)
+        sum += m(i, i);
+
+    return sum;
+}
+
+// Binary matrix files. A 64-byte header carries the element type, shape and
+// the offset of the data, which starts on a page boundary so the payload can
+// be mapped directly. Rows follow back to back in native byte order.
+enum class MatrixDType : uint16_t {
+    Int32 = 1,
+    Int64 = 2,
+    Float32 = 3,
+    Float64 = 4
+};
+
+template<typename T>
+struct MatrixDTypeOf;
+
+template<> struct MatrixDTypeOf<int32_t> : integral_constant<MatrixDType, MatrixDType::Int32> {};
+template<> struct MatrixDTypeOf<int64_t> : integral_constant<MatrixDType, MatrixDType::Int64> {};
+template<> struct MatrixDTypeOf<float> : integral_constant<MatrixDType, MatrixDType::Float32> {};
+template<> struct MatrixDTypeOf<double> : integral_constant<MatrixDType, MatrixDType::Float64> {};
+
+struct MatrixFileHeader {
+    static constexpr char magicValue[4] = { 'M', 'T', 'R', 'X' };
+    static constexpr uint16_t currentVersion = 1;
+    static constexpr uint32_t byteOrderMark = 0x01020304;
+    static constexpr uint64_t dataAlignment = 4096;
+
+    char magic[4];
+    uint16_t version;
+    uint16_t dtype;
+    uint32_t byteOrder;
+    uint32_t elementSize;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t dataOffset;
+    uint64_t alignment;
+    uint64_t reserved[2];
+};
+
+static_assert(sizeof(MatrixFileHeader) == 64, "MatrixFileHeader must stay 64 bytes");
+
+// Writes a matrix file row by row, so matrices larger than memory can be
+// produced incrementally. The row count is patched into the header by close().
+template<typename T>
+class MatrixFileWriter {
+public:
+
+    MatrixFileWriter(const char* path, int cols)
+        : file_(fopen(path, "wb")), cols_(cols), rows_(0)
+    {
+        if (!file_) {
+            cerr << "Error: Cannot open " << path << " for writing\n";
+            return;
+        }
+
+        setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+        char zeros[MatrixFileHeader::dataAlignment] = {};
+        if (fwrite(zeros, 1, sizeof(zeros), file_) != sizeof(zeros))
+            fail();
+    }
+
+    MatrixFileWriter(const MatrixFileWriter&) = delete;
+    MatrixFileWriter& operator=(const MatrixFileWriter&) = delete;
+
+    ~MatrixFileWriter() {
+        close();
+    }
+
+    explicit operator bool() const noexcept {
+        return file_ != nullptr;
+    }
+
+    bool writeRows(const T* data, int count) {
+
+        if (!file_)
+            return false;
+
+        size_t n = static_cast<size_t>(count) * cols_;
+        if (fwrite(data, sizeof(T), n, file_) != n)
+            return fail();
+
+        rows_ += count;
+        return true;
+    }
+
+    bool writeRow(const T* row) {
+        return writeRows(row, 1);
+    }
+
+    // Finalises the header; returns false if any write failed.
+    bool close() {
+
+        if (!file_)
+            return false;
+
+        MatrixFileHeader header = {};
+        memcpy(header.magic, MatrixFileHeader::magicValue, sizeof(header.magic));
+        header.version = MatrixFileHeader::currentVersion;
+        header.dtype = static_cast<uint16_t>(MatrixDTypeOf<T>::value);
+        header.byteOrder = MatrixFileHeader::byteOrderMark;
+        header.elementSize = sizeof(T);
+        header.rows = rows_;
+        header.cols = static_cast<uint64_t>(cols_);
+        header.dataOffset = MatrixFileHeader::dataAlignment;
+        header.alignment = MatrixFileHeader::dataAlignment;
+
+        bool ok = fseek(file_, 0, SEEK_SET) == 0
+               && fwrite(&header, sizeof(header), 1, file_) == 1;
+        ok = (fclose(file_) == 0) && ok;
+        file_ = nullptr;
+
+        if (!ok)
+            cerr << "Error: Failed to write matrix file\n";
+        return ok;
+    }
+
+private:
+    FILE* file_;
+    int cols_;
+    uint64_t rows_;
+
+    bool fail() {
+        cerr << "Error: Failed to write matrix file\n";
+        fclose(file_);
+        file_ = nullptr;
+        return false;
+    }
+};
+
+template<typename T>
+bool Matrix<T>::save(const char* path) const {
+
+    MatrixFileWriter<T> writer(path, cols_);
+
+    for (int i = 0; i < rows_; ++i)
+        if (!writer.writeRow(data() + static_cast<size_t>(i) * ld_))
+            return false;
+
+    return writer.close();
+}
+
+// Read-only view of a matrix file mapped with mmap. Nothing is copied or
+// read up front; only the pages actually touched are faulted in. Usable as a
+// leaf in Matrix expressions, e.g. Matrix<double> m = mapped * 2.0.
+template<typename T>
+class MappedMatrix : public MatrixExpr<MappedMatrix<T>> {
+public:
+    using value_type = T;
+    static constexpr bool elementwise = false;
+
+    explicit MappedMatrix(const char* path) {
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error: Cannot open " << path << "\n";
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(MatrixFileHeader)) {
+            void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (base != MAP_FAILED) {
+                base_ = base;
+                length_ = st.st_size;
+            }
+        }
+        ::close(fd);
+
+        if (!base_ || !validate()) {
+            cerr << "Error: " << path << " is not a valid matrix file for this element type\n";
+            unmap();
+        }
+    }
+
+    MappedMatrix(const MappedMatrix&) = delete;
+    MappedMatrix& operator=(const MappedMatrix&) = delete;
+
+    MappedMatrix(MappedMatrix&& other) noexcept
+        : base_(other.base_), length_(other.length_), data_(other.data_), rows_(other.rows_), cols_(other.cols_)
+    {
+        other.base_ = nullptr;
+        other.data_ = nullptr;
+        other.rows_ = other.cols_ = 0;
+    }
+
+    ~MappedMatrix() {
+        unmap();
+    }
+
+    explicit operator bool() const noexcept {
+        return data_ != nullptr;
+    }
+
+    int rows() const noexcept {
+        return rows_;
+    }
+
+    int cols() const noexcept {
+        return cols_;
+    }
+
+    size_t size() const noexcept {
+        return static_cast<size_t>(rows_) * cols_;
+    }
+
+    const T* data() const noexcept {
+        return data_;
+    }
+
+    MatrixView<const T> view() const noexcept {
+        return MatrixView<const T>(data_, rows_, cols_, cols_);
+    }
+
+    const T& operator()(int i, int j) const {
+
+        if (i < 0 || i >= rows_ || j < 0 || j >= cols_) {
+            cerr << "Error: Index out of bounds\n";
+            return data_[0];
+        }
+
+        return data_[static_cast<size_t>(i) * cols_ + j];
+    }
+
+    const T& coeff(int i, int j) const noexcept {
+        return data_[static_cast<size_t>(i) * cols_ + j];
+    }
+
+private:
+    void* base_ = nullptr;
+    size_t length_ = 0;
+    const T* data_ = nullptr;
+    int rows_ = 0, cols_ = 0;
+
+    bool validate() {
+
+        MatrixFileHeader header;
+        memcpy(&header, base_, sizeof(header));
+
+        if (memcmp(header.magic, MatrixFileHeader::magicValue, sizeof(header.magic)) != 0
+            || header.version != MatrixFileHeader::currentVersion
+            || header.byteOrder != MatrixFileHeader::byteOrderMark
+            || header.dtype != static_cast<uint16_t>(MatrixDTypeOf<T>::value)
+            || header.elementSize != sizeof(T)
+            || header.dataOffset % alignof(T) != 0
+            || header.rows > static_cast<uint64_t>(numeric_limits<int>::max())
+            || header.cols > static_cast<uint64_t>(numeric_limits<int>::max()))
+            return false;
+
+        // Compare by division: rows * cols * sizeof(T) can wrap even when
+        // both extents fit in an int.
+        if (header.dataOffset > length_)
+            return false;
+        uint64_t available = (length_ - header.dataOffset) / sizeof(T);
+        if (header.cols != 0 && header.rows > available / header.cols)
+            return false;
+
+        data_ = reinterpret_cast<const T*>(static_cast<const char*>(base_) + header.dataOffset);
+        rows_ = static_cast<int>(header.rows);
+        cols_ = static_cast<int>(header.cols);
+        return true;
+    }
+
+    void unmap() {
+
+        if (base_)
+            munmap(base_, length_);
+        base_ = nullptr;
+        data_ = nullptr;
+        rows_ = cols_ = 0;
+    }
+};
+
+// Bulk text I/O. A text matrix has one row per line with elements separated
+// by spaces, tabs or a single comma, so both whitespace-separated and CSV
+// files read back; blank lines are skipped, empty CSV fields are errors.
+// Parsing goes through from_chars straight into the matrix storage and
+// writing through to_chars into a reusable buffer, bypassing iostream
+// formatting.
+namespace detail {
+
+inline bool isTextSeparator(char c) noexcept {
+    return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+inline const char* skipTextBlanks(const char* p, const char* end) noexcept {
+    while (p < end && *p != ',' && isTextSeparator(*p))
+        ++p;
+    return p;
+}
+
+// Skips the blanks after an element and at most one comma with the blanks
+// around it. Returns nullptr when the comma opens an empty field, i.e. it is
+// followed by another comma or by the end of the line.
+inline const char* skipTextSeparators(const char* p, const char* end) noexcept {
+
+    p = skipTextBlanks(p, end);
+    if (p == end || *p != ',')
+        return p;
+
+    p = skipTextBlanks(p + 1, end);
+    return p == end || *p == ',' ? nullptr : p;
+}
+
+inline const char* lineEnd(const char* p, const char* last) noexcept {
+    const void* nl = memchr(p, '\n', static_cast<size_t>(last - p));
+    return nl ? static_cast<const char*>(nl) : last;
+}
+
+// Parses one element at p; returns nullptr unless a whole token was consumed.
+template<typename T>
+const char* parseTextElement(const char* p, const char* end, T& value) noexcept {
+
+    if (p < end && *p == '+')
+        ++p;
+
+    auto [next, ec] = from_chars(p, end, value);
+    if (ec != errc() || next == p || (next < end && !isTextSeparator(*next)))
+        return nullptr;
+
+    return next;
+}
+
+// Largest text form of one element with to_chars, plus a separator.
+template<typename T>
+constexpr size_t maxTextElement = is_floating_point<T>::value ? 32 : numeric_limits<T>::digits10 + 4;
+
+// Formats m row by row into a 1 MB buffer and hands each full buffer to sink.
+template<typename T, typename Sink>
+bool formatText(MatrixView<const T> m, char separator, Sink sink) {
+
+    constexpr size_t bufferSize = 1 << 20;
+    thread_local vector<char> buffer(bufferSize);
+
+    char* out = buffer.data();
+    char* limit = buffer.data() + bufferSize - maxTextElement<T>;
+
+    for (int i = 0; i < m.rows(); ++i) {
+        for (int j = 0; j < m.cols(); ++j) {
+            if (out > limit) {
+                if (!sink(buffer.data(), static_cast<size_t>(out - buffer.data())))
+                    return false;
+                out = buffer.data();
+            }
+            auto [next, ec] = to_chars(out, limit + maxTextElement<T> - 1, m.coeff(i, j));
+            if (ec != errc()) {
+                cerr << "Error: Cannot format element (" << i << ", " << j << ")\n";
+                return false;
+            }
+            out = next;
+            *out++ = j + 1 < m.cols() ? separator : '\n';
+        }
+    }
+
+    return sink(buffer.data(), static_cast<size_t>(out - buffer.data()));
+}
+
+} // namespace detail
+
 template<typename T>
-class Matrix {
-public:
+Matrix<T> parse_matrix_text(string_view text) {
 
-    Matrix(int rows, int cols)
-        : rows_(rows), cols_(cols), data_(make_unique<T[]>(rows * cols))
-    {
-        for (int i = 0; i < rows_ * cols_; ++i)
-            data_[i] = T();
-    }
+    static_assert(is_arithmetic<T>::value, "Text matrices hold arithmetic elements");
 
-    Matrix(const Matrix& other)
-        : rows_(other.rows_), cols_(other.cols_), data_(make_unique<T[]>(other.rows_ * other.cols_))
-    {
-        copy(other.data_.get(), other.data_.get() + rows_ * cols_, data_.get());
-    }
+    const char* first = text.data();
+    const char* last = first + text.size();
 
-    Matrix(Matrix&& other) noexcept
-        : rows_(other.rows_), cols_(other.cols_), data_(move(other.data_))
-    {
-        other.rows_ = other.cols_ = 0;
+    // First pass: count the non-blank lines and the elements of the first one.
+    // Malformed separators are reported by the second pass.
+    int rows = 0, cols = 0;
+    for (const char* line = first; line < last; ) {
+        const char* end = detail::lineEnd(line, last);
+        const char* p = detail::skipTextBlanks(line, end);
+        if (p < end) {
+            if (rows == 0) {
+                while (p && p < end) {
+                    p = detail::skipTextSeparators(find_if(p, end, detail::isTextSeparator), end);
+                    ++cols;
+                }
+            }
+            ++rows;
+        }
+        line = end + (end < last);
     }
 
-    Matrix& operator=(const Matrix& other) {
+    Matrix<T> result(rows, cols, uninitialized);
 
-        if (this != &other) {
-            rows_ = other.rows_;
-            cols_ = other.cols_;
-            data_ = make_unique<T[]>(rows_ * cols_);
-            copy(other.data_.get(), other.data_.get() + rows_ * cols_, data_.get());
+    int i = 0, lineNumber = 0;
+    for (const char* line = first; line < last; ) {
+        const char* end = detail::lineEnd(line, last);
+        const char* p = detail::skipTextBlanks(line, end);
+        ++lineNumber;
+
+        if (p < end) {
+            T* row = result.data() + static_cast<size_t>(i) * result.ld();
+            int j = 0;
+
+            while (p < end) {
+                if (j == cols) {
+                    cerr << "Error: Line " << lineNumber << " has more than " << cols << " elements\n";
+                    return Matrix<T>(0, 0);
+                }
+                if (*p == ',') {
+                    cerr << "Error: Empty field on line " << lineNumber << ", column " << (p - line + 1) << "\n";
+                    return Matrix<T>(0, 0);
+                }
+                const char* next = detail::parseTextElement(p, end, row[j++]);
+                if (!next) {
+                    cerr << "Error: Invalid number on line " << lineNumber << ", column " << (p - line + 1) << "\n";
+                    return Matrix<T>(0, 0);
+                }
+                p = detail::skipTextSeparators(next, end);
+                if (!p) {
+                    const char* comma = find(next, end, ',');
+                    cerr << "Error: Empty field on line " << lineNumber << ", column " << (comma - line + 2) << "\n";
+                    return Matrix<T>(0, 0);
+                }
+            }
+
+            if (j != cols) {
+                cerr << "Error: Line " << lineNumber << " has " << j << " elements, expected " << cols << "\n";
+                return Matrix<T>(0, 0);
+            }
+            ++i;
         }
+        line = end + (end < last);
+    }
 
-        return *this;
+    return result;
+}
+
+// Maps the file and parses it in place, without copying it into memory first.
+template<typename T>
+Matrix<T> read_matrix_text(const char* path) {
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        cerr << "Error: Cannot open " << path << "\n";
+        return Matrix<T>(0, 0);
     }
 
-    Matrix& operator=(Matrix&& other) noexcept {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return Matrix<T>(0, 0);
+    }
 
-        if (this != &other) {
-            rows_ = other.rows_;
-            cols_ = other.cols_;
-            data_ = move(other.data_);
-            other.rows_ = other.cols_ = 0;
-        }
+    size_t length = static_cast<size_t>(st.st_size);
+    void* base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
 
-        return *this;
+    if (base == MAP_FAILED) {
+        cerr << "Error: Cannot map " << path << "\n";
+        return Matrix<T>(0, 0);
     }
 
-    T& operator()(int i, int j) {
+    madvise(base, length, MADV_SEQUENTIAL);
+    Matrix<T> result = parse_matrix_text<T>(string_view(static_cast<const char*>(base), length));
+    munmap(base, length);
 
-        if (i < 0 || i >= rows_ || j < 0 || j >= cols_) {
-            cerr << "Error: Index out of bounds\n";
-            return data_[0];
-        }
+    return result;
+}
+
+template<typename T>
+bool write_matrix_text(MatrixView<const T> m, ostream& os, char separator = ' ') {
+    return detail::formatText(m, separator, [&](const char* data, size_t n) {
+        return static_cast<bool>(os.write(data, static_cast<streamsize>(n)));
+    });
+}
+
+template<typename T>
+bool write_matrix_text(const Matrix<T>& m, ostream& os, char separator = ' ') {
+    return write_matrix_text(m.view(), os, separator);
+}
+
+template<typename T>
+bool write_matrix_text(const Matrix<T>& m, const char* path, char separator = ' ') {
 
-        return data_[i * cols_ + j];
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        cerr << "Error: Cannot open " << path << " for writing\n";
+        return false;
     }
 
-    const T& operator()(int i, int j) const {
+    bool ok = detail::formatText(m.view(), separator, [&](const char* data, size_t n) {
+        return fwrite(data, 1, n, file) == n;
+    });
+    ok = (fclose(file) == 0) && ok;
 
-        if (i < 0 || i >= rows_ || j < 0 || j >= cols_) {
-            cerr << "Error: Index out of bounds\n";
-            return data_[0];
-        }
+    if (!ok)
+        cerr << "Error: Failed to write " << path << "\n";
+    return ok;
+}
+
+// Benchmark mode: `Matrix --bench [options]` sweeps operations, element
+// types, sizes and thread counts and prints one JSON document on stdout.
+// After a thread-count change the pool is woken and every operation runs
+// once untimed; then each gets its own warmup runs and timed repetitions.
+// The median is the primary figure (GFLOP/s and GB/s use it) and the
+// minimum is reported beside it. Threads are pinned (worker i to CPU i,
+// the main thread to CPU 0) so repeated runs land on the same cores.
+// Baselines that are only worth timing on request are left out of the
+// default --ops list: mul_naive is the original triple-loop product and
+// sparse_mul multiplies a CSR matrix of the given --density by a dense one,
+// to set against mul at the same size. strassen times multiply_strassen with
+// the default crossover; its GFLOP/s count the classical 2n^3 operations so
+// it compares directly with mul. text_write and text_read time the
+// to_chars/from_chars text path on an n x n matrix; iostream_write and
+// iostream_read do the same through operator<< and operator>>.
+namespace bench {
+
+// Bumped by the replacement operator new below while counting is set, which
+// --bench and --selftest do; the interactive mode pays nothing for them.
+atomic<bool> counting{false};
+atomic<size_t> allocations{0};
+atomic<size_t> allocatedBytes{0};
 
-        return data_[i * cols_ + j];
+inline void* countedAlloc(size_t size, size_t alignment) {
+
+    if (counting.load(memory_order_relaxed)) {
+        allocations.fetch_add(1, memory_order_relaxed);
+        allocatedBytes.fetch_add(size, memory_order_relaxed);
     }
 
-    int rows() const noexcept { 
-        return rows_; 
+    if (alignment <= alignof(max_align_t)) {
+        if (void* p = malloc(size ? size : 1))
+            return p;
+        throw bad_alloc();
     }
 
-    int cols() const noexcept { 
-        return cols_; 
+    // Over-aligned blocks are carved from a plain malloc with the original
+    // pointer stored just below them. glibc's memalign splits a fragment off
+    // every request, so a freed matrix buffer is not handed back until the
+    // heap has crept up several times, and every run that creeps page-faults
+    // its result in again.
+    if (size > SIZE_MAX - alignment - sizeof(void*))
+        throw bad_alloc();
+    void* raw = malloc(size + alignment + sizeof(void*));
+    if (!raw)
+        throw bad_alloc();
+
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + alignment - 1) & ~(alignment - 1);
+    void* p = reinterpret_cast<void*>(aligned);
+    static_cast<void**>(p)[-1] = raw;
+    return p;
+}
+
+// Kept out of line: once inlined into a delete expression, GCC pairs this
+// free() with the matching new expression and warns about the mismatch.
+[[gnu::noinline]] inline void countedFree(void* p, size_t alignment = alignof(max_align_t)) noexcept {
+    if (p && alignment > alignof(max_align_t))
+        p = static_cast<void**>(p)[-1];
+    free(p);
+}
+
+struct Options {
+    vector<string> ops{ "add", "sub", "mul", "transpose", "trace" };
+    vector<string> types{ "int", "float", "double" };
+    vector<int> sizes{ 64, 256, 1024 };
+    vector<unsigned> threads = thread::hardware_concurrency() > 1
+                             ? vector<unsigned>{ 1, thread::hardware_concurrency() }
+                             : vector<unsigned>{ 1 };
+    int warmup = 2;
+    int repetitions = 5;
+    double density = 0.01;
+};
+
+struct Result {
+    string op, type;
+    int size;
+    unsigned threads;
+    double minSeconds, medianSeconds;
+    double flops, bytes;
+    size_t allocations, allocatedBytes;
+};
+
+inline const char* isaName(simd::Isa isa) {
+
+    switch (isa) {
+    case simd::Isa::SSE2: return "sse2";
+    case simd::Isa::AVX2: return "avx2";
+    case simd::Isa::AVX512: return "avx512";
+    default: return "scalar";
     }
+}
 
-    friend ostream& operator<<(ostream& os, const Matrix& m) {
+template<typename T>
+vector<T> parseList(const string& text) {
 
-        for (int i = 0; i < m.rows_; ++i) {
-            for (int j = 0; j < m.cols_; ++j)
-                os << m(i, j) << (j + 1 < m.cols_ ? ' ' : '\n');
+    vector<T> values;
+    for (size_t pos = 0; pos <= text.size(); ) {
+        size_t comma = min(text.find(',', pos), text.size());
+        string item = text.substr(pos, comma - pos);
+        if constexpr (is_same<T, string>::value) {
+            values.push_back(item);
+        } else {
+            T v{};
+            auto [end, ec] = from_chars(item.data(), item.data() + item.size(), v);
+            if (ec != errc() || end != item.data() + item.size() || v <= 0)
+                return {};
+            values.push_back(v);
         }
+        pos = comma + 1;
+    }
+    return values;
+}
 
-        return os;
+inline bool parseOptions(int argc, char* argv[], Options& options) {
+
+    for (int i = 0; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string key = arg.substr(0, eq), value = eq == string::npos ? string() : arg.substr(eq + 1);
+        bool ok = true;
+
+        if (key == "--ops")
+            ok = !(options.ops = parseList<string>(value)).empty();
+        else if (key == "--types")
+            ok = !(options.types = parseList<string>(value)).empty();
+        else if (key == "--sizes")
+            ok = !(options.sizes = parseList<int>(value)).empty();
+        else if (key == "--threads")
+            ok = !(options.threads = parseList<unsigned>(value)).empty();
+        else if (key == "--warmup")
+            ok = from_chars(value.data(), value.data() + value.size(), options.warmup).ec == errc();
+        else if (key == "--density")
+            ok = from_chars(value.data(), value.data() + value.size(), options.density).ec == errc()
+                 && options.density > 0 && options.density <= 1;
+        else if (key == "--reps")
+            ok = from_chars(value.data(), value.data() + value.size(), options.repetitions).ec == errc()
+                 && options.repetitions > 0;
+        else
+            ok = false;
+
+        if (!ok) {
+            cerr << "Error: Bad benchmark option " << arg << "\n"
+                 << "Usage: --bench [--ops=add,sub,mul,transpose,trace] [--types=int,float,double]\n"
+                 << "               [--sizes=64,256,1024] [--threads=1,N] [--warmup=2] [--reps=5]\n"
+                 << "               [--density=0.01]\n"
+                 << "Extra ops: mul_naive, sparse_mul, strassen, text_write, text_read,\n"
+                 << "           iostream_write, iostream_read\n";
+            return false;
+        }
     }
+    return true;
+}
 
-    friend Matrix operator+(const Matrix& a, const Matrix& b) {
+template<typename T>
+Matrix<T> randomMatrix(int n, mt19937& gen) {
 
-        if (a.rows_ != b.rows_ || a.cols_ != b.cols_) {
-            cerr << "Error: Incompatible dimensions for addition\n";
-            return Matrix(0, 0);
+    uniform_int_distribution<int> dist(-100, 100);
+    Matrix<T> m(n, n);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            m(i, j) = static_cast<T>(dist(gen));
+    return m;
+}
+
+// The unblocked i-j-k product that operator* used before the blocked kernel.
+template<typename T>
+Matrix<T> naiveMultiply(const Matrix<T>& a, const Matrix<T>& b) {
+
+    Matrix<T> result(a.rows(), b.cols());
+    for (int i = 0; i < a.rows(); ++i) {
+        for (int j = 0; j < b.cols(); ++j) {
+            T sum = T();
+            for (int k = 0; k < a.cols(); ++k)
+                sum += a(i, k) * b(k, j);
+            result(i, j) = sum;
         }
+    }
+    return result;
+}
 
-        Matrix result(a.rows_, a.cols_);
+// The element-by-element iostream equivalents of write_matrix_text() and
+// parse_matrix_text(), with enough digits to round-trip.
+template<typename T>
+string iostreamWrite(const Matrix<T>& m) {
 
-        for (int i = 0; i < a.rows_ * a.cols_; ++i)
-            result.data_[i] = a.data_[i] + b.data_[i];
+    ostringstream os;
+    os.precision(numeric_limits<T>::max_digits10);
+    for (int i = 0; i < m.rows(); ++i)
+        for (int j = 0; j < m.cols(); ++j)
+            os << m(i, j) << (j + 1 < m.cols() ? ' ' : '\n');
+    return os.str();
+}
 
-        return result;
+template<typename T>
+Matrix<T> iostreamRead(const string& text, int rows, int cols) {
+
+    istringstream is(text);
+    Matrix<T> m(rows, cols, uninitialized);
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+            is >> m(i, j);
+    return m;
+}
+
+// n x n CSR matrix whose entries are non-zero with the given probability.
+template<typename T>
+SparseMatrix<T> randomSparse(int n, double density, mt19937& gen) {
+
+    bernoulli_distribution keep(density);
+    uniform_int_distribution<int> dist(1, 100);
+    Matrix<T> m(n, n);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j)
+            if (keep(gen))
+                m(i, j) = static_cast<T>(dist(gen));
+    return SparseMatrix<T>(m);
+}
+
+// Times run() and fills in everything except the operation's name and cost.
+template<typename Run>
+Result measure(const Options& options, Run run) {
+
+    for (int i = 0; i < options.warmup; ++i)
+        run();
+
+    vector<double> seconds;
+    seconds.reserve(static_cast<size_t>(options.repetitions));
+    size_t allocs = allocations.load(), bytes = allocatedBytes.load();
+
+    for (int i = 0; i < options.repetitions; ++i) {
+        auto start = chrono::steady_clock::now();
+        run();
+        seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
     }
 
-    friend Matrix operator-(const Matrix& a, const Matrix& b) {
+    sort(seconds.begin(), seconds.end());
 
-        if (a.rows_ != b.rows_ || a.cols_ != b.cols_) {
-            cerr << "Error: Incompatible dimensions for subtraction\n";
-            return Matrix(0, 0);
+    Result r{};
+    r.minSeconds = seconds.front();
+    r.medianSeconds = seconds[seconds.size() / 2];
+    r.allocations = (allocations.load() - allocs) / options.repetitions;
+    r.allocatedBytes = (allocatedBytes.load() - bytes) / options.repetitions;
+    return r;
+}
+
+template<typename T>
+void runType(const Options& options, const string& type, vector<Result>& results) {
+
+    mt19937 gen(12345);
+    volatile T sink = T();
+
+    auto wants = [&](const char* op) {
+        return find(options.ops.begin(), options.ops.end(), op) != options.ops.end();
+    };
+
+    for (int n : options.sizes) {
+        Matrix<T> a = randomMatrix<T>(n, gen), b = randomMatrix<T>(n, gen);
+        double elements = static_cast<double>(n) * n;
+        SparseMatrix<T> sparse = wants("sparse_mul") ? randomSparse<T>(n, options.density, gen) : SparseMatrix<T>(n, n);
+        ostringstream textStream;
+        if (wants("text_write") || wants("text_read") || wants("iostream_write") || wants("iostream_read"))
+            write_matrix_text(a, textStream);
+        const string text = textStream.str();
+
+        for (unsigned threads : options.threads) {
+            exec::set_thread_count(threads, true);
+            bool parallel = threads > 1;
+
+            // Wake every worker once so thread start-up is not timed.
+            ThreadPool::global().parallelFor(threads, [](size_t) {});
+
+            struct Case {
+                string op;
+                function<void()> run;
+                double flops, bytes;
+            };
+
+            vector<Case> cases;
+            for (const string& op : options.ops) {
+                if (op == "add") {
+                    cases.push_back({ op, [&] { sink = (parallel ? add(a, b, exec::parallel) : add(a, b, exec::seq))(0, 0); },
+                                      elements, 3 * elements * sizeof(T) });
+                } else if (op == "sub") {
+                    cases.push_back({ op, [&] { sink = (parallel ? subtract(a, b, exec::parallel) : subtract(a, b, exec::seq))(0, 0); },
+                                      elements, 3 * elements * sizeof(T) });
+                } else if (op == "mul") {
+                    cases.push_back({ op, [&] { sink = (parallel ? multiply(a, b, exec::parallel) : multiply(a, b, exec::seq))(0, 0); },
+                                      2 * elements * n, 3 * elements * sizeof(T) });
+                } else if (op == "mul_naive") {
+                    cases.push_back({ op, [&] { sink = naiveMultiply(a, b)(0, 0); },
+                                      2 * elements * n, 3 * elements * sizeof(T) });
+                } else if (op == "strassen") {
+                    cases.push_back({ op, [&] { sink = multiply_strassen(a, b)(0, 0); },
+                                      2 * elements * n, 3 * elements * sizeof(T) });
+                } else if (op == "sparse_mul") {
+                    cases.push_back({ op, [&] { sink = (sparse * b)(0, 0); },
+                                      2 * static_cast<double>(sparse.nonZeros()) * n,
+                                      (sparse.nonZeros() + 2 * elements) * sizeof(T) });
+                } else if (op == "text_write") {
+                    cases.push_back({ op, [&] {
+                                          ostringstream os;
+                                          write_matrix_text(a, os);
+                                          sink = static_cast<T>(os.tellp());
+                                      },
+                                      0, static_cast<double>(text.size()) });
+                } else if (op == "text_read") {
+                    cases.push_back({ op, [&] { sink = parse_matrix_text<T>(text)(0, 0); },
+                                      0, static_cast<double>(text.size()) });
+                } else if (op == "iostream_write") {
+                    cases.push_back({ op, [&] { sink = static_cast<T>(iostreamWrite(a).size()); },
+                                      0, static_cast<double>(text.size()) });
+                } else if (op == "iostream_read") {
+                    cases.push_back({ op, [&] { sink = iostreamRead<T>(text, n, n)(0, 0); },
+                                      0, static_cast<double>(text.size()) });
+                } else if (op == "transpose") {
+                    cases.push_back({ op, [&] { sink = (parallel ? transpose(a, exec::parallel) : transpose(a, exec::seq))(0, 0); },
+                                      0, 2 * elements * sizeof(T) });
+                } else if (op == "trace") {
+                    cases.push_back({ op, [&] { sink = trace(a); },
+                                      static_cast<double>(n), static_cast<double>(n) * sizeof(T) });
+                } else {
+                    cerr << "Error: Unknown benchmark operation " << op << "\n";
+                }
+            }
+
+            // One untimed pass over every operation before any is measured, so
+            // the first in the list does not pay page faults and allocator
+            // growth on behalf of the rest.
+            for (const Case& c : cases)
+                c.run();
+
+            for (const Case& c : cases) {
+                Result r = measure(options, c.run);
+                r.op = c.op;
+                r.type = type;
+                r.size = n;
+                r.threads = threads;
+                r.flops = c.flops;
+                r.bytes = c.bytes;
+                results.push_back(r);
+            }
         }
+    }
+}
 
-        Matrix result(a.rows_, a.cols_);
+inline void printJson(const Options& options, const vector<Result>& results) {
 
-        for (int i = 0; i < a.rows_ * a.cols_; ++i)
-            result.data_[i] = a.data_[i] - b.data_[i];
+    cout << "{\n"
+         << "  \"isa\": \"" << isaName(simd::detectIsa()) << "\",\n"
+         << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n"
+         << "  \"warmup\": " << options.warmup << ",\n"
+         << "  \"repetitions\": " << options.repetitions << ",\n"
+         << "  \"density\": " << options.density << ",\n"
+         << "  \"results\": [";
 
-        return result;
+    // A run too fast for the clock has no meaningful rate; JSON has no inf.
+    auto rate = [](double amount, double seconds) {
+        double perSecond = amount / seconds * 1e-9;
+        if (!(seconds > 0) || !isfinite(perSecond))
+            return string("null");
+        ostringstream os;
+        os << perSecond;
+        return os.str();
+    };
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        cout << (i ? "," : "") << "\n    { \"op\": \"" << r.op << "\", \"type\": \"" << r.type
+             << "\", \"size\": " << r.size << ", \"threads\": " << r.threads
+             << ", \"median_seconds\": " << r.medianSeconds << ", \"min_seconds\": " << r.minSeconds
+             << ", \"gflops\": " << rate(r.flops, r.medianSeconds)
+             << ", \"gbytes_per_second\": " << rate(r.bytes, r.medianSeconds)
+             << ", \"allocations\": " << r.allocations << ", \"allocated_bytes\": " << r.allocatedBytes << " }";
     }
 
-    Matrix operator*(const Matrix& b) const {
+    cout << "\n  ]\n}\n";
+}
+
+inline int run(int argc, char* argv[]) {
 
-        if (cols_ != b.rows_) {
-            cerr << "Error: Incompatible dimensions for multiplication\n";
-            return Matrix(0, 0);
-        }
+    Options options;
+    if (!parseOptions(argc, argv, options))
+        return 1;
 
-        Matrix result(rows_, b.cols_);
+    ThreadPool::pinCurrentThread(0);
+    counting = true;
 
-        for (int i = 0; i < rows_; ++i) {
-            for (int j = 0; j < b.cols_; ++j) {
+    vector<Result> results;
+    for (const string& type : options.types) {
+        if (type == "int")
+            runType<int>(options, type, results);
+        else if (type == "float")
+            runType<float>(options, type, results);
+        else if (type == "double")
+            runType<double>(options, type, results);
+        else
+            cerr << "Error: Unknown benchmark type " << type << "\n";
+    }
+
+    printJson(options, results);
+    return 0;
+}
+
+} // namespace bench
+
+// Self-check mode: `Matrix --selftest` runs every check below, prints one
+// line per check and exits non-zero if any of them fails.
+namespace selftest {
+
+template<typename T>
+vector<T> randomValues(size_t n, mt19937& gen) {
+
+    vector<T> values(n);
+    if constexpr (is_floating_point<T>::value) {
+        uniform_real_distribution<T> dist(-1, 1);
+        for (T& v : values)
+            v = dist(gen);
+    } else {
+        uniform_int_distribution<int> dist(-100, 100);
+        for (T& v : values)
+            v = static_cast<T>(dist(gen));
+    }
+    return values;
+}
+
+// Runs the elementwise kernels and a blocked product with partial edge tiles
+// through every ISA table this host supports and compares each result with
+// the scalar table. Integer results and the elementwise floating-point ones
+// (a single rounding each) must match bit for bit; floating-point products
+// may differ by FMA contraction and summation order, so each element only
+// has to lie within 2 k eps |alpha| sum |a||b| of the scalar one.
+template<typename T>
+bool kernelsAgreeAcrossIsas() {
+
+    constexpr int m = 67, n = 83, k = 301;
+    constexpr size_t elements = 1001;
+
+    mt19937 gen(2);
+    vector<T> a = randomValues<T>(static_cast<size_t>(m) * k, gen);
+    vector<T> b = randomValues<T>(static_cast<size_t>(k) * n, gen);
+    vector<T> x = randomValues<T>(elements, gen), y = randomValues<T>(elements, gen);
+
+    auto outputs = [&](const simd::Kernels<T>& kernels) {
+        vector<T> out(static_cast<size_t>(m) * n + 3 * elements, T());
+        detail::gemmBlocked(m, n, k, T(3), a.data(), k, 1, b.data(), n, 1, out.data(), n, kernels.microKernel);
+        T* rest = out.data() + static_cast<size_t>(m) * n;
+        kernels.add(x.data(), y.data(), rest, elements);
+        kernels.sub(x.data(), y.data(), rest + elements, elements);
+        kernels.scale(x.data(), T(-7), rest + 2 * elements, elements);
+        return out;
+    };
+
+    const vector<T> expected = outputs(simd::kernelsFor<T>(simd::Isa::Scalar));
+
+    vector<T> bound(static_cast<size_t>(m) * n, T());
+    if constexpr (is_floating_point<T>::value) {
+        for (int i = 0; i < m; ++i)
+            for (int j = 0; j < n; ++j) {
                 T sum = T();
-                for (int k = 0; k < cols_; ++k)
-                    sum += (*this)(i, k) * b(k, j);
-                result(i, j) = sum;
+                for (int p = 0; p < k; ++p)
+                    sum += abs(a[static_cast<size_t>(i) * k + p] * b[static_cast<size_t>(p) * n + j]);
+                bound[static_cast<size_t>(i) * n + j] = 2 * k * numeric_limits<T>::epsilon() * 3 * sum;
             }
+    }
+
+    auto agrees = [&](const vector<T>& out) {
+        for (size_t i = 0; i < out.size(); ++i) {
+            bool same = i < bound.size() ? abs(out[i] - expected[i]) <= bound[i] : out[i] == expected[i];
+            if (!same)
+                return false;
         }
+        return true;
+    };
 
-        return result;
+    bool ok = true;
+
+    for (simd::Isa isa : { simd::Isa::SSE2, simd::Isa::AVX2, simd::Isa::AVX512 }) {
+        if (static_cast<int>(isa) > static_cast<int>(simd::detectIsa())) {
+            cout << "        " << bench::isaName(isa) << " not supported here, skipped\n";
+            continue;
+        }
+        if (!agrees(outputs(simd::kernelsFor<T>(isa)))) {
+            cout << "        " << bench::isaName(isa) << " differs from scalar\n";
+            ok = false;
+        }
     }
+    return ok;
+}
 
-private:
-    int rows_, cols_;
-    unique_ptr<T[]> data_;
-};
+// A task that throws, on a worker or on the calling thread, reaches the
+// caller of parallelFor() as that exception, and the pool keeps working.
+inline bool poolRethrowsTaskExceptions() {
+
+    ThreadPool pool(4);
+    bool ok = true;
+
+    auto throws = [&](const function<void(size_t)>& body) {
+        try {
+            pool.parallelFor(64, body);
+        } catch (const runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+
+    if (!throws([](size_t) { throw runtime_error("every task"); })) {
+        cout << "        an exception from every task was lost\n";
+        ok = false;
+    }
+    if (!throws([](size_t task) { if (task == 37) throw runtime_error("one task"); })) {
+        cout << "        an exception from one task was lost\n";
+        ok = false;
+    }
+
+    atomic<size_t> ran{0};
+    pool.parallelFor(64, [&](size_t) { ++ran; });
+    if (ran != 64) {
+        cout << "        " << ran << " of 64 tasks ran after the exceptions\n";
+        ok = false;
+    }
+    return ok;
+}
+
+// After one warm-up call has sized the packing buffers, repeated gemm, axpy
+// and transpose_into calls must not touch the heap.
+inline bool inPlaceRoutinesDoNotAllocate() {
+
+    mt19937 gen(5);
+    Matrix<double> a = bench::randomMatrix<double>(150, gen), b = bench::randomMatrix<double>(150, gen);
+    Matrix<double> c(150, 150), t(150, 150);
+    Matrix<double> small = bench::randomMatrix<double>(7, gen), smallC(7, 7);
+
+    auto iteration = [&] {
+        gemm(1.5, a, b, 0.5, c);
+        gemm(1.0, small, small, 0.0, smallC);
+        gemm(2.0, a.view().transposed(), b.view(), 1.0, c.view());
+        axpy(0.25, a, c);
+        transpose_into(a, t);
+        transpose_into(a.view().block(0, 0, 70, 90), t.view().block(0, 0, 90, 70));
+    };
+
+    iteration();
+    size_t before = bench::allocations.load();
+    for (int i = 0; i < 10; ++i)
+        iteration();
+    size_t allocs = bench::allocations.load() - before;
+
+    if (allocs)
+        cout << "        " << allocs << " allocations in 10 iterations\n";
+    return allocs == 0;
+}
+
+// A saved matrix maps back; a header whose rows * cols * sizeof(T) wraps
+// around, or a file cut short of its data, is rejected.
+inline bool mappedFilesAreValidated() {
+
+    char path[] = "/tmp/matrix-selftest-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return false;
+    ::close(fd);
+
+    Matrix<double> m(3, 5);
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 5; ++j)
+            m(i, j) = i * 10 + j;
+
+    auto patch = [&](uint64_t rows, uint64_t cols, off_t length) {
+        if (!m.save(path))
+            return false;
+        int file = open(path, O_RDWR);
+        if (file < 0)
+            return false;
+        bool ok = pwrite(file, &rows, sizeof(rows), offsetof(MatrixFileHeader, rows)) == sizeof(rows)
+               && pwrite(file, &cols, sizeof(cols), offsetof(MatrixFileHeader, cols)) == sizeof(cols)
+               && (length < 0 || ftruncate(file, length) == 0);
+        ::close(file);
+        return ok;
+    };
+
+    bool ok = patch(3, 5, -1) && MappedMatrix<double>(path) && MappedMatrix<double>(path)(2, 4) == 24;
+
+    // 1073807362 * 2147352580 * 8 wraps to 64 bytes.
+    ok = ok && patch(1073807362, 2147352580, 8192) && !MappedMatrix<double>(path);
+    ok = ok && patch(3, 5, MatrixFileHeader::dataAlignment + 10 * sizeof(double)) && !MappedMatrix<double>(path);
+
+    unlink(path);
+    return ok;
+}
+
+template<typename L, typename R>
+bool sameElements(const MatrixExpr<L>& l, const MatrixExpr<R>& r) {
 
+    const L& a = l.self();
+    const R& b = r.self();
+    if (a.rows() != b.rows() || a.cols() != b.cols())
+        return false;
+
+    for (int i = 0; i < a.rows(); ++i)
+        for (int j = 0; j < a.cols(); ++j)
+            if (a.coeff(i, j) != b.coeff(i, j))
+                return false;
+    return true;
+}
+
+// Products and sums of blocks read the blocks in place: the only allocation
+// is the result (plus Strassen's workspace), and every routine matches the
+// product of copied-out operands.
+inline bool viewOperandsAreNotCopied() {
+
+    mt19937 gen(10);
+    Matrix<double> a = bench::randomMatrix<double>(600, gen), b = bench::randomMatrix<double>(600, gen);
+    MatrixView<const double> va = a.view().block(10, 20, 400, 300), vb = b.view().block(5, 7, 300, 360);
+    Matrix<double> ca(va), cb(vb);
+    Matrix<double> expected = ca * cb;
+
+    size_t before = bench::allocations.load();
+    Matrix<double> product = va * vb;
+    size_t allocs = bench::allocations.load() - before;
+
+    unsigned threads = exec::thread_count();
+    exec::set_thread_count(4);
+
+    bool ok = allocs == 1 && sameElements(product, expected);
+    ok = ok && sameElements(multiply(va, vb, exec::parallel), expected);
+    ok = ok && sameElements(multiply_strassen(va, vb, 64), multiply_strassen(ca, cb, 64));
+    ok = ok && sameElements(multiply(vb.transposed(), va.transposed(), exec::seq), transpose(expected));
+
+    MatrixView<const double> vc = a.view().block(0, 0, 400, 300);
+    ok = ok && sameElements(add(va, vc, exec::seq), ca + Matrix<double>(vc));
+    ok = ok && sameElements(subtract(va, vc, exec::parallel), ca - Matrix<double>(vc));
+    ok = ok && sameElements(add(va.transposed(), vc.transposed(), exec::parallel), transpose(Matrix<double>(ca + Matrix<double>(vc))));
+    exec::set_thread_count(threads);
+
+    if (allocs != 1)
+        cout << "        block * block made " << allocs << " allocations\n";
+    return ok;
+}
+
+// A matrix allocates only its own padded layout. Transposing it in place
+// allocates just the cycle bitset when the padded transpose fits in that
+// buffer, and otherwise one buffer of exactly the transposed size. Either
+// way, transposing back allocates no more than the bitset, and the round
+// trip is exact.
 template<typename T>
-Matrix<T> transpose(const Matrix<T>& m) {
+bool transposeInPlaceGrowsOnlyWhenNeeded(int rows, int cols) {
+
+    size_t bytes = bench::allocatedBytes.load();
+    Matrix<T> m(rows, cols);
+    bytes = bench::allocatedBytes.load() - bytes;
+    size_t buffer = m.storageSize();
+    bool ok = bytes == buffer * sizeof(T);
+
+    for (int i = 0; i < rows; ++i)
+        for (int j = 0; j < cols; ++j)
+            m(i, j) = static_cast<T>(i * 7 + j % 13);
+    Matrix<T> expected = transpose(m);
+
+    size_t bitset = m.size() / 8 + 64;
+    size_t allocs = bench::allocations.load();
+    bytes = bench::allocatedBytes.load();
+    transpose_in_place(m);
+    allocs = bench::allocations.load() - allocs;
+    bytes = bench::allocatedBytes.load() - bytes;
+
+    bool grew = m.storageSize() > buffer;
+    ok = ok && sameElements(m, expected)
+        && (grew ? allocs == 1 && bytes == m.storageSize() * sizeof(T) : allocs <= 1 && bytes <= bitset);
+
+    size_t backAllocs = bench::allocations.load(), backBytes = bench::allocatedBytes.load();
+    transpose_in_place(m);
+    backAllocs = bench::allocations.load() - backAllocs;
+    backBytes = bench::allocatedBytes.load() - backBytes;
+    ok = ok && backAllocs <= 1 && backBytes <= bitset && sameElements(m, transpose(expected));
+
+    if (!ok)
+        cout << "        " << rows << "x" << cols << ": " << allocs << " allocations, " << bytes << " bytes, then "
+             << backAllocs << " allocations, " << backBytes << " bytes back\n";
+    return ok;
+}
+
+inline bool transposeInPlaceGrowsSparingly() {
+    return transposeInPlaceGrowsOnlyWhenNeeded<double>(1001, 3000)
+        && transposeInPlaceGrowsOnlyWhenNeeded<double>(1000, 3000)
+        && transposeInPlaceGrowsOnlyWhenNeeded<double>(4, 100000)
+        && transposeInPlaceGrowsOnlyWhenNeeded<float>(9, 1000)
+        && transposeInPlaceGrowsOnlyWhenNeeded<int>(333, 17);
+}
+
+// Strassen's error against the classical product, relative to ||A|| ||B||
+// in the Frobenius norm, must stay within the n^log2(12) * eps growth the
+// recursion allows. An odd size exercises the peeled edges.
+template<typename T>
+bool strassenErrorIsBounded() {
+
+    const int n = 517, crossover = 64;
+    mt19937 gen(12);
+    uniform_real_distribution<T> dist(-1, 1);
+
+    Matrix<T> a(n, n), b(n, n);
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < n; ++j) {
+            a(i, j) = dist(gen);
+            b(i, j) = dist(gen);
+        }
+
+    Matrix<T> classic = multiply(a, b, exec::seq);
+    Matrix<T> fast = multiply_strassen(a, b, crossover);
+
+    auto norm = [](const Matrix<T>& m) {
+        double sum = 0;
+        for (int i = 0; i < m.rows(); ++i)
+            for (int j = 0; j < m.cols(); ++j)
+                sum += static_cast<double>(m(i, j)) * m(i, j);
+        return sqrt(sum);
+    };
+
+    double error = norm(Matrix<T>(fast - classic)) / (norm(a) * norm(b));
+    double bound = pow(static_cast<double>(n), log2(12.0)) * numeric_limits<T>::epsilon();
+
+    cout << "        " << (is_same<T, float>::value ? "float" : "double") << ": relative error " << error
+         << ", bound " << bound << "\n";
+    return error <= bound;
+}
+
+// Whitespace and CSV text parse; an empty CSV field is an error rather
+// than being merged into its neighbour; written text reads back exactly.
+inline bool textFormatIsStrict() {
 
-    Matrix<T> result(m.cols(), m.rows());
+    Matrix<int> csv = parse_matrix_text<int>("1, 2 ,3\r\n\n4,5,\t6\n");
+    Matrix<int> spaced = parse_matrix_text<int>("  1 2\t3\n4   5 6");
+    bool ok = csv.rows() == 2 && csv.cols() == 3 && sameElements(csv, spaced) && csv(1, 2) == 6;
 
+    for (const char* bad : { "1,,3\n", "1,2,\n", ",1,2\n", "1,2,3\n4,,6\n", "1 , ,3\n" })
+        ok = ok && parse_matrix_text<int>(bad).rows() == 0;
+
+    mt19937 gen(14);
+    uniform_real_distribution<double> dist(-1e6, 1e6);
+    Matrix<double> m(37, 23);
     for (int i = 0; i < m.rows(); ++i)
         for (int j = 0; j < m.cols(); ++j)
-            result(j, i) = m(i, j);
+            m(i, j) = dist(gen);
 
-    return result;
+    for (char separator : { ' ', ',' }) {
+        ostringstream os;
+        ok = ok && write_matrix_text(m, os, separator) && sameElements(parse_matrix_text<double>(os.str()), m);
+    }
+    return ok;
 }
 
-template<typename T>
-T trace(const Matrix<T>& m) {
+struct Check {
+    const char* name;
+    bool (*run)();
+};
 
-    if (m.rows() != m.cols()) {
-        cerr << "Error: Trace only defined for square matrices\n";
-        return T();
+inline int run() {
+
+    bench::counting = true;
+
+    const Check checks[] = {
+        { "int kernels bit-identical across ISAs", kernelsAgreeAcrossIsas<int> },
+        { "float kernels agree across ISAs", kernelsAgreeAcrossIsas<float> },
+        { "double kernels agree across ISAs", kernelsAgreeAcrossIsas<double> },
+        { "parallelFor rethrows task exceptions on the caller", poolRethrowsTaskExceptions },
+        { "gemm/axpy/transpose_into allocation-free after warm-up", inPlaceRoutinesDoNotAllocate },
+        { "mapped matrix files with bad extents are rejected", mappedFilesAreValidated },
+        { "view operands are multiplied and added in place", viewOperandsAreNotCopied },
+        { "transpose_in_place grows the buffer only when needed", transposeInPlaceGrowsSparingly },
+        { "Strassen error within n^log2(12) eps (double)", strassenErrorIsBounded<double> },
+        { "Strassen error within n^log2(12) eps (float)", strassenErrorIsBounded<float> },
+        { "text parser rejects empty CSV fields and round-trips", textFormatIsStrict },
+    };
+
+    int failed = 0;
+    for (const Check& check : checks) {
+        bool ok = check.run();
+        cout << (ok ? "ok      " : "FAILED  ") << check.name << "\n";
+        failed += !ok;
     }
+    return failed ? 1 : 0;
+}
 
-    T sum = T();
-    for (int i = 0; i < m.rows(); ++i)
-        sum += m(i, i);
+} // namespace selftest
 
-    return sum;
+// Global allocation functions route through the benchmark counters, so the
+// JSON report can show how many allocations each operation performs. They
+// only count while bench::counting is set.
+void* operator new(size_t size) {
+    return bench::countedAlloc(size, alignof(max_align_t));
+}
+
+void* operator new[](size_t size) {
+    return bench::countedAlloc(size, alignof(max_align_t));
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+    return bench::countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+    return bench::countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept { bench::countedFree(p); }
+void operator delete[](void* p) noexcept { bench::countedFree(p); }
+void operator delete(void* p, size_t) noexcept { bench::countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { bench::countedFree(p); }
+void operator delete(void* p, align_val_t alignment) noexcept {
+    bench::countedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void* p, align_val_t alignment) noexcept {
+    bench::countedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p, size_t, align_val_t alignment) noexcept {
+    bench::countedFree(p, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void* p, size_t, align_val_t alignment) noexcept {
+    bench::countedFree(p, static_cast<size_t>(alignment));
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return bench::run(argc - 2, argv + 2);
+    if (argc > 1 && strcmp(argv[1], "--selftest") == 0)
+        return selftest::run();
 
     int row1, col1, row2, col2;
 
@@ -4,63 +4,835 @@
 #include <type_traits>
 #include <memory>
 #include <functional>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <optional>
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <typeinfo>
+#include <cassert>
 
 using namespace std;
 
 namespace my {
 
-template<typename T, typename Deleter = std::default_delete<T>>
-class shared_ptr {
+// Reference-count policies. single_threaded is a plain counter for pointers
+// that never leave one thread. multi_threaded, the default, lets copies be
+// made and dropped on any thread: increments are relaxed, and the decrement
+// is acq_rel so every write made through any copy happens-before the delete.
+struct single_threaded {
+    class counter {
+    public:
+        explicit counter(std::size_t n) noexcept : n(n) {}
+
+        void increment() noexcept { ++n; }
+
+        void add(std::size_t k) noexcept { n += k; }
+
+        // True when this was the last reference.
+        bool decrement() noexcept { return --n == 0; }
+
+        // Increments unless the count already reached zero.
+        bool try_increment() noexcept { return n != 0 && ++n; }
+
+        std::size_t load() const noexcept { return n; }
+
+    private:
+        std::size_t n;
+    };
+};
+
+struct multi_threaded {
+    class counter {
+    public:
+        explicit counter(std::size_t n) noexcept : n(n) {}
+
+        void increment() noexcept { n.fetch_add(1, std::memory_order_relaxed); }
+
+        void add(std::size_t k) noexcept { n.fetch_add(k, std::memory_order_relaxed); }
+
+        bool decrement() noexcept { return n.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+        bool try_increment() noexcept {
+            std::size_t c = n.load(std::memory_order_relaxed);
+            while (c != 0)
+                if (n.compare_exchange_weak(c, c + 1, std::memory_order_relaxed))
+                    return true;
+            return false;
+        }
+
+        std::size_t load() const noexcept { return n.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<std::size_t> n;
+    };
+};
+
+// Counters of the control-block pool, summed over all threads.
+struct pool_stats {
+    std::size_t hits;     // blocks served from a free list
+    std::size_t misses;   // blocks carved from a slab
+    std::size_t live;     // blocks currently allocated
+};
+
+namespace detail {
+
+// Slab allocator for control blocks. Every thread owns a cache with one free
+// list and one slab per 16-byte size class, so allocation and same-thread
+// frees touch no shared state. A block freed on another thread is pushed
+// onto its owner's lock-free remote list, which the owner takes over in one
+// exchange when its local list runs dry. Slabs are aligned to their size, so
+// a block finds its owning cache by masking its address. Caches of exited
+// threads are handed to new threads instead of being freed, because their
+// blocks may still be alive. To allocate control blocks with plain
+// new/delete, e.g. under ASan or Valgrind, either define MY_SHARED_PTR_NO_POOL
+// at build time or set it in the environment (to anything but "0") before
+// the program starts; the environment is read once, at the first allocation.
+class BlockPool {
+public:
+    static constexpr std::size_t granularity = 16;
+    static constexpr std::size_t classes = 16;
+    static constexpr std::size_t maxBlock = granularity * classes;
+    static constexpr std::size_t slabSize = 64 * 1024;
+    static constexpr std::size_t slabHeader = 64;
+
+    static bool enabled() noexcept {
+        static const bool on = [] {
+            const char* off = std::getenv("MY_SHARED_PTR_NO_POOL");
+            return !off || std::strcmp(off, "0") == 0;
+        }();
+        return on;
+    }
+
+    static void* allocate(std::size_t size) {
+        if (size > maxBlock || !enabled())
+            return ::operator new(size);
+
+        std::size_t c = (size - 1) / granularity;
+        if (Cache* cache = current())
+            return allocateFrom(*cache, c);
+
+        // Threads past their thread_local teardown share one locked cache.
+        std::lock_guard<std::mutex> lock(registryMutex());
+        return allocateFrom(fallback(), c);
+    }
+
+    static void deallocate(void* p, std::size_t size) noexcept {
+        if (size > maxBlock || !enabled()) {
+            ::operator delete(p);
+            return;
+        }
+
+        std::size_t c = (size - 1) / granularity;
+        Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<std::uintptr_t>(p) & ~(slabSize - 1));
+        Cache* owner = slab->owner;
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+
+        // Only look at the calling thread's cache; a thread that never
+        // allocated has none, and creating one here could throw.
+        if (owner == threadState().cache) {
+            block->next = owner->local[c];
+            owner->local[c] = block;
+            bump(owner->frees);
+            return;
+        }
+
+        FreeBlock* head = owner->remote[c].load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!owner->remote[c].compare_exchange_weak(head, block, std::memory_order_release,
+                                                         std::memory_order_relaxed));
+        owner->remoteFrees.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static pool_stats stats() {
+        std::lock_guard<std::mutex> lock(registryMutex());
+
+        std::size_t allocated = 0, freed = 0;
+        pool_stats s{0, 0, 0};
+        for (Cache* cache : registry()) {
+            s.hits += cache->hits.load(std::memory_order_relaxed);
+            s.misses += cache->misses.load(std::memory_order_relaxed);
+            freed += cache->frees.load(std::memory_order_relaxed)
+                   + cache->remoteFrees.load(std::memory_order_relaxed);
+        }
+        allocated = s.hits + s.misses;
+        s.live = allocated - freed;
+        return s;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Cache {
+        FreeBlock* local[classes] = {};
+        std::atomic<FreeBlock*> remote[classes] = {};
+        char* next[classes] = {};
+        char* end[classes] = {};
+
+        // hits, misses and frees have a single writer, the owning thread.
+        std::atomic<std::size_t> hits{0};
+        std::atomic<std::size_t> misses{0};
+        std::atomic<std::size_t> frees{0};
+        std::atomic<std::size_t> remoteFrees{0};
+    };
+
+    struct Slab {
+        Cache* owner;
+    };
+
+    struct ThreadState {
+        Cache* cache;
+        bool exited;
+    };
+
+    // Hands the cache back when the thread exits.
+    struct ThreadGuard {
+        ~ThreadGuard() {
+            ThreadState& state = threadState();
+            std::lock_guard<std::mutex> lock(registryMutex());
+            orphans().push_back(state.cache);
+            state.cache = nullptr;
+            state.exited = true;
+        }
+    };
+
+    static void bump(std::atomic<std::size_t>& counter) noexcept {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static void* allocateFrom(Cache& cache, std::size_t c) {
+        FreeBlock* block = cache.local[c];
+        if (!block)
+            block = cache.remote[c].exchange(nullptr, std::memory_order_acquire);
+
+        if (block) {
+            cache.local[c] = block->next;
+            bump(cache.hits);
+            return block;
+        }
+
+        std::size_t blockSize = (c + 1) * granularity;
+        if (static_cast<std::size_t>(cache.end[c] - cache.next[c]) < blockSize) {
+            void* memory = std::aligned_alloc(slabSize, slabSize);
+            if (!memory)
+                throw std::bad_alloc();
+            static_cast<Slab*>(memory)->owner = &cache;
+            cache.next[c] = static_cast<char*>(memory) + slabHeader;
+            cache.end[c] = static_cast<char*>(memory) + slabSize;
+        }
+
+        void* p = cache.next[c];
+        cache.next[c] += blockSize;
+        bump(cache.misses);
+        return p;
+    }
+
+    // The calling thread's cache, or nullptr once its thread_locals are
+    // being destroyed.
+    static Cache* current() {
+        ThreadState& state = threadState();
+        if (state.cache || state.exited)
+            return state.cache;
+
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            if (!orphans().empty()) {
+                state.cache = orphans().back();
+                orphans().pop_back();
+            } else {
+                state.cache = new Cache;
+                registry().push_back(state.cache);
+            }
+        }
+
+        thread_local ThreadGuard guard;
+        (void)guard;
+        return state.cache;
+    }
+
+    static ThreadState& threadState() {
+        thread_local ThreadState state{nullptr, false};
+        return state;
+    }
+
+    static Cache& fallback() {
+        static Cache* cache = [] {
+            Cache* c = new Cache;
+            registry().push_back(c);
+            return c;
+        }();
+        return *cache;
+    }
+
+    static std::mutex& registryMutex() {
+        static std::mutex* m = new std::mutex;
+        return *m;
+    }
+
+    static std::vector<Cache*>& registry() {
+        static std::vector<Cache*>* caches = new std::vector<Cache*>;
+        return *caches;
+    }
+
+    static std::vector<Cache*>& orphans() {
+        static std::vector<Cache*>* caches = new std::vector<Cache*>;
+        return *caches;
+    }
+};
+
+// Holds a deleter or allocator. Empty class types are kept as a base so
+// they take no space in the object that embeds them.
+template<typename T, bool = std::is_empty<T>::value && !std::is_final<T>::value>
+class Compressed : private T {
+public:
+    explicit Compressed(T value) : T(std::move(value)) {}
+
+    T& get() noexcept { return *this; }
+};
+
+template<typename T>
+class Compressed<T, false> {
+public:
+    explicit Compressed(T value) : value(std::move(value)) {}
+
+    T& get() noexcept { return value; }
+
+private:
+    T value;
+};
+
+// Type-erased control block. dispose() ends the managed object's lifetime and
+// destroy() frees the block, so a shared_ptr does not depend on how either
+// was allocated. The object dies with the last strong reference; the block
+// lives on while weak references remain. All strong references together
+// hold one weak reference, so the block is freed exactly once. Blocks are
+// 16-byte aligned so atomic_shared_ptr can tag their addresses.
+template<typename Policy>
+struct alignas(16) ControlBlockBase {
+    typename Policy::counter strong{1};
+    typename Policy::counter weak{1};
+
+    virtual void* object() noexcept = 0;
+    virtual void* deleter(const std::type_info& type) noexcept = 0;
+    virtual void dispose() noexcept = 0;
+    virtual void destroy() noexcept = 0;
+
+protected:
+    ~ControlBlockBase() = default;
+};
+
+// Block for an object allocated separately and released through a deleter.
+// The deleter's type is erased here, inside the block, so every shared_ptr<T>
+// is one type; a stateless deleter adds no bytes, and a stateful one is
+// stored inline rather than behind another allocation.
+template<typename T, typename Deleter, typename Policy>
+struct PointerBlock final : ControlBlockBase<Policy>, private Compressed<Deleter> {
+    T* ptr;
+
+    PointerBlock(T* p, Deleter d)
+        : Compressed<Deleter>(std::move(d)), ptr(p) {}
+
+    void* object() noexcept override { return const_cast<std::remove_cv_t<T>*>(ptr); }
+
+    void* deleter(const std::type_info& type) noexcept override {
+        return type == typeid(Deleter) ? std::addressof(this->get()) : nullptr;
+    }
+
+    void dispose() noexcept override { this->get()(ptr); }
+
+    void destroy() noexcept override { delete this; }
+
+#ifndef MY_SHARED_PTR_NO_POOL
+    static void* operator new(std::size_t size) {
+        static_assert(alignof(PointerBlock) <= BlockPool::granularity, "Pool blocks are 16-byte aligned");
+        return BlockPool::allocate(size);
+    }
+
+    static void operator delete(void* p, std::size_t size) noexcept {
+        BlockPool::deallocate(p, size);
+    }
+#endif
+};
+
+// Block that holds the object itself, so make_shared/allocate_shared need a
+// single allocation and the object sits next to its reference count.
+template<typename T, typename Alloc, typename Policy>
+struct InlineBlock final
+    : ControlBlockBase<Policy>,
+      private Compressed<typename std::allocator_traits<Alloc>::template rebind_alloc<T>> {
+    using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<InlineBlock>;
+    using ValueAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+    alignas(T) unsigned char storage[sizeof(T)];
+
+    template<typename... Args>
+    InlineBlock(const Alloc& a, Args&&... args) : Compressed<ValueAlloc>(ValueAlloc(a)) {
+        std::allocator_traits<ValueAlloc>::construct(this->get(), value(), std::forward<Args>(args)...);
+    }
+
+    T* value() noexcept { return reinterpret_cast<T*>(storage); }
+
+    void* object() noexcept override { return const_cast<std::remove_cv_t<T>*>(value()); }
+
+    void* deleter(const std::type_info&) noexcept override { return nullptr; }
+
+    void dispose() noexcept override {
+        std::allocator_traits<ValueAlloc>::destroy(this->get(), value());
+    }
+
+    void destroy() noexcept override {
+        BlockAlloc blockAlloc(this->get());
+        this->~InlineBlock();
+        std::allocator_traits<BlockAlloc>::deallocate(blockAlloc, this, 1);
+    }
+};
+
+// Layout checks: a stateless deleter costs nothing, a stateful one exactly its
+// own size, rounded up to the block alignment.
+struct BareBlock : ControlBlockBase<multi_threaded> {
+    void* ptr;
+};
+
+template<typename Deleter>
+constexpr std::size_t pointerBlockSize = sizeof(PointerBlock<int, Deleter, multi_threaded>);
+
+constexpr std::size_t withState(std::size_t bytes) {
+    return (sizeof(BareBlock) + bytes + alignof(BareBlock) - 1) / alignof(BareBlock) * alignof(BareBlock);
+}
+
+struct StatelessDeleterProbe {
+    void operator()(int* p) const { delete p; }
+};
+
+static_assert(pointerBlockSize<std::default_delete<int>> == sizeof(BareBlock), "default_delete must take no space");
+static_assert(pointerBlockSize<StatelessDeleterProbe> == sizeof(BareBlock), "Stateless deleters must take no space");
+static_assert(pointerBlockSize<void(*)(int*)> == withState(sizeof(void(*)(int*))), "Function pointers are stored inline");
+static_assert(pointerBlockSize<std::function<void(int*)>> == withState(sizeof(std::function<void(int*)>)),
+              "Stateful deleters are stored inline");
+static_assert(sizeof(InlineBlock<int, std::allocator<int>, multi_threaded>) == sizeof(BareBlock),
+              "std::allocator must take no space");
+
+// Deferred reclamation. While a thread is inside a deferred::scope, a
+// multi_threaded control block whose strong count drops to zero is not
+// disposed on the spot but appended to that thread's retire list. The list
+// is handed to a shared queue in batches (and whenever the outermost scope
+// ends); a background reclaimer thread or an explicit drain() then runs the
+// deleters. single_threaded blocks are always released inline, since their
+// weak count must not be touched from another thread.
+//
+// retire() runs inside shared_ptr's noexcept release, so it never allocates
+// in a way that can throw: batches are fixed-size arrays linked through
+// their own header and recycled after reclamation, and if no batch can be
+// had the block is simply released inline.
+class Reclaimer {
+public:
+    using Block = ControlBlockBase<multi_threaded>;
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::size_t batchSize = 64;
+    static constexpr std::size_t maxSpareBatches = 16;
+
+    struct Stats {
+        std::size_t pending;
+        std::size_t reclaimed;
+        double maxLagMs;
+        double meanLagMs;
+    };
+
+    static bool deferring() noexcept {
+        ThreadState& state = threadState();
+        return state.depth > 0 && !state.exited;
+    }
+
+    static void enter() {
+        ThreadState& state = threadState();
+        if (!state.registered) {
+            thread_local ThreadGuard guard;
+            (void)guard;
+            state.registered = true;
+        }
+        if (!state.current)
+            state.current = acquireBatch();
+        ++state.depth;
+    }
+
+    static void leave() noexcept {
+        ThreadState& state = threadState();
+        if (--state.depth == 0)
+            flush(state);
+    }
+
+    static void retire(Block* cb) noexcept {
+        ThreadState& state = threadState();
+        if (!state.current && !(state.current = acquireBatch())) {
+            release(cb);
+            return;
+        }
+
+        Batch& batch = *state.current;
+        batch.items[batch.size++] = Retired{cb, Clock::now()};
+        shared().pending.fetch_add(1, std::memory_order_relaxed);
+        if (batch.size == batchSize)
+            flush(state);
+    }
+
+    // Hands this thread's list over and reclaims everything queued so far.
+    // Deferral is off while it runs, so the releases the reclaimed objects
+    // make in turn happen inline instead of refilling the queue.
+    static void drain() noexcept {
+        ThreadState& state = threadState();
+        if (!state.exited)
+            flush(state);
+
+        int depth = state.depth;
+        state.depth = 0;
+        reclaim(takeQueue());
+        state.depth = depth;
+    }
+
+    static void start() {
+        Shared& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.worker.joinable())
+            return;
+        s.stop = false;
+        s.worker = std::thread([] { run(); });
+    }
+
+    // Stops the background thread after it has reclaimed what was queued.
+    static void stop() {
+        Shared& s = shared();
+        std::thread worker;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.stop = true;
+            worker = std::move(s.worker);
+        }
+        s.wake.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    static Stats stats() {
+        Shared& s = shared();
+        std::lock_guard<std::mutex> lock(s.statsMutex);
+        std::size_t reclaimed = s.reclaimed;
+        return Stats{s.pending.load(std::memory_order_relaxed), reclaimed, s.maxLagMs,
+                     reclaimed ? s.totalLagMs / static_cast<double>(reclaimed) : 0.0};
+    }
+
 private:
-    struct ControlBlock {
-        T* ptr;
-        std::size_t count;
-        Deleter deleter;
+    struct Retired {
+        Block* cb;
+        Clock::time_point at;
+    };
+
+    struct Batch {
+        Batch* next;
+        std::size_t size;
+        Retired items[batchSize];
+    };
+
+    struct ThreadState {
+        Batch* current;
+        int depth;
+        bool registered;
+        bool exited;
+    };
+
+    struct ThreadGuard {
+        ~ThreadGuard() {
+            ThreadState& state = threadState();
+            flush(state);
+            if (state.current) {
+                recycle(state.current);
+                state.current = nullptr;
+            }
+            state.exited = true;
+        }
+    };
+
+    // Queued batches run oldest first; reclaimed ones wait on the spare list
+    // for reuse.
+    struct Shared {
+        std::mutex mutex;
+        std::condition_variable wake;
+        Batch* head = nullptr;
+        Batch* tail = nullptr;
+        Batch* spare = nullptr;
+        std::size_t spareCount = 0;
+        std::thread worker;
+        bool stop = false;
 
-        ControlBlock(T* p, Deleter d)
-            : ptr(p), count(1), deleter(std::move(d)) {}
+        std::atomic<std::size_t> pending{0};
+        std::mutex statsMutex;
+        std::size_t reclaimed = 0;
+        double maxLagMs = 0;
+        double totalLagMs = 0;
     };
 
+    static ThreadState& threadState() noexcept {
+        thread_local ThreadState state{nullptr, 0, false, false};
+        return state;
+    }
+
+    // Never destroyed, so blocks retired during static destruction still
+    // have somewhere to go.
+    static Shared& shared() {
+        static Shared* s = new Shared;
+        return *s;
+    }
+
+    static void release(Block* cb) noexcept {
+        cb->dispose();
+        if (cb->weak.decrement())
+            cb->destroy();
+    }
+
+    static Batch* acquireBatch() noexcept {
+        Shared& s = shared();
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (Batch* batch = s.spare) {
+                s.spare = batch->next;
+                --s.spareCount;
+                batch->next = nullptr;
+                batch->size = 0;
+                return batch;
+            }
+        }
+        Batch* batch = new (std::nothrow) Batch;
+        if (batch) {
+            batch->next = nullptr;
+            batch->size = 0;
+        }
+        return batch;
+    }
+
+    static void recycle(Batch* batch) noexcept {
+        Shared& s = shared();
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (s.spareCount < maxSpareBatches) {
+                batch->next = s.spare;
+                s.spare = batch;
+                ++s.spareCount;
+                return;
+            }
+        }
+        delete batch;
+    }
+
+    static void flush(ThreadState& state) noexcept {
+        Batch* batch = state.current;
+        if (!batch || batch->size == 0)
+            return;
+        state.current = nullptr;
+
+        Shared& s = shared();
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            if (s.tail)
+                s.tail->next = batch;
+            else
+                s.head = batch;
+            s.tail = batch;
+        }
+        s.wake.notify_one();
+    }
+
+    static Batch* takeQueue() noexcept {
+        Shared& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        Batch* batches = s.head;
+        s.head = s.tail = nullptr;
+        return batches;
+    }
+
+    static void reclaim(Batch* batches) noexcept {
+        Shared& s = shared();
+        while (Batch* batch = batches) {
+            batches = batch->next;
+
+            double maxLag = 0, totalLag = 0;
+            for (std::size_t i = 0; i < batch->size; ++i) {
+                const Retired& r = batch->items[i];
+                double lag = std::chrono::duration<double, std::milli>(Clock::now() - r.at).count();
+                maxLag = std::max(maxLag, lag);
+                totalLag += lag;
+                release(r.cb);
+            }
+
+            std::size_t count = batch->size;
+            recycle(batch);
+
+            s.pending.fetch_sub(count, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(s.statsMutex);
+            s.reclaimed += count;
+            s.maxLagMs = std::max(s.maxLagMs, maxLag);
+            s.totalLagMs += totalLag;
+        }
+    }
+
+    static void run() {
+        Shared& s = shared();
+        for (;;) {
+            Batch* batches;
+            {
+                std::unique_lock<std::mutex> lock(s.mutex);
+                s.wake.wait(lock, [&] { return s.stop || s.head; });
+                if (!s.head)
+                    return;
+                batches = s.head;
+                s.head = s.tail = nullptr;
+            }
+            reclaim(batches);
+        }
+    }
+};
+
+} // namespace detail
+
+inline pool_stats block_pool_stats() {
+    return detail::BlockPool::stats();
+}
+
+inline bool block_pool_enabled() noexcept {
+#ifdef MY_SHARED_PTR_NO_POOL
+    return false;
+#else
+    return detail::BlockPool::enabled();
+#endif
+}
+
+namespace deferred {
+
+using stats_type = detail::Reclaimer::Stats;
+
+// Defers the final releases made by this thread for as long as it lives;
+// scopes nest.
+class scope {
+public:
+    scope() { detail::Reclaimer::enter(); }
+    ~scope() { detail::Reclaimer::leave(); }
+
+    scope(const scope&) = delete;
+    scope& operator=(const scope&) = delete;
+};
+
+// Reclaims every retired block on the calling thread.
+inline void drain() { detail::Reclaimer::drain(); }
+
+inline void start_reclaimer() { detail::Reclaimer::start(); }
+
+inline void stop_reclaimer() { detail::Reclaimer::stop(); }
+
+// Queue depth (retired, not yet reclaimed), blocks reclaimed so far, and the
+// worst and mean time between retirement and reclamation.
+inline stats_type stats() { return detail::Reclaimer::stats(); }
+
+} // namespace deferred
+
+template<typename T, typename Policy>
+class shared_ptr;
+
+template<typename T, typename Policy>
+class weak_ptr;
+
+template<typename T>
+class atomic_shared_ptr;
+
+template<typename T, typename Policy = multi_threaded, typename Alloc, typename... Args>
+shared_ptr<T, Policy> allocate_shared(const Alloc& alloc, Args&&... args);
+
+// The pointer is kept next to the control block pointer, so get() does not
+// have to go through the block. The deleter only matters when the block is
+// created, so it is not part of the type.
+template<typename T, typename Policy = multi_threaded>
+class shared_ptr {
+private:
+    using ControlBlock = detail::ControlBlockBase<Policy>;
+
+    template<typename Deleter>
+    using PointerBlock = detail::PointerBlock<T, std::decay_t<Deleter>, Policy>;
+
+    T* ptr;
     ControlBlock* cb;
 
+    // Adopts one strong reference already counted in block.
+    shared_ptr(ControlBlock* block, T* p) noexcept : ptr(p), cb(block) {}
+
     void release() noexcept {
         if (!cb) 
             return;
-        if (--cb->count == 0) {
-            if (cb->ptr) cb->deleter(cb->ptr);
-            delete cb;
+        if (cb->strong.decrement()) {
+            if constexpr (std::is_same<Policy, multi_threaded>::value) {
+                if (detail::Reclaimer::deferring()) {
+                    detail::Reclaimer::retire(cb);
+                    ptr = nullptr;
+                    cb = nullptr;
+                    return;
+                }
+            }
+            cb->dispose();
+            if (cb->weak.decrement())
+                cb->destroy();
         }
+        ptr = nullptr;
         cb = nullptr;
     }
 
+    template<typename U, typename P, typename Alloc, typename... Args>
+    friend shared_ptr<U, P> allocate_shared(const Alloc& alloc, Args&&... args);
+
+    template<typename D, typename U, typename P>
+    friend D* get_deleter(const shared_ptr<U, P>& p) noexcept;
+
+    friend class weak_ptr<T, Policy>;
+    friend class atomic_shared_ptr<T>;
+
 public:
-    shared_ptr() noexcept : cb(nullptr) {}
+    shared_ptr() noexcept : ptr(nullptr), cb(nullptr) {}
 
-    explicit shared_ptr(T* p) : cb(nullptr) {
-        if (p) 
-            cb = new ControlBlock(p, Deleter{});
-    }
+    shared_ptr(std::nullptr_t) noexcept : shared_ptr() {}
+
+    explicit shared_ptr(T* p) : shared_ptr(p, std::default_delete<T>()) {}
 
-    shared_ptr(T* p, Deleter d) : cb(nullptr) {
-        if (p) 
-            cb = new ControlBlock(p, std::move(d));
+    template<typename Deleter>
+    shared_ptr(T* p, Deleter d) : ptr(nullptr), cb(nullptr) {
+        if (p) {
+            cb = new PointerBlock<Deleter>(p, std::move(d));
+            ptr = p;
+        }
     }
 
-    shared_ptr(const shared_ptr& other) noexcept : cb(other.cb) {
+    shared_ptr(const shared_ptr& other) noexcept : ptr(other.ptr), cb(other.cb) {
         if (cb)
-            ++cb->count;
+            cb->strong.increment();
     }
 
-    shared_ptr(shared_ptr&& other) noexcept : cb(other.cb) {
+    shared_ptr(shared_ptr&& other) noexcept : ptr(other.ptr), cb(other.cb) {
+        other.ptr = nullptr;
         other.cb = nullptr;
     }
 
     shared_ptr& operator=(const shared_ptr& other) noexcept {
         if (this != &other) {
             release();
+            ptr = other.ptr;
             cb = other.cb;
             if (cb)
-                ++cb->count;
+                cb->strong.increment();
         }
         return *this;
     }
@@ -68,7 +840,9 @@ public:
     shared_ptr& operator=(shared_ptr&& other) noexcept {
         if (this != &other) {
             release();
+            ptr = other.ptr;
             cb = other.cb;
+            other.ptr = nullptr;
             other.cb = nullptr;
         }
         return *this;
@@ -79,7 +853,7 @@ public:
     }
 
     T* get() const noexcept { 
-        return cb ? cb->ptr : nullptr; 
+        return ptr; 
     }
 
     T& operator*() const noexcept { 
@@ -94,19 +868,454 @@ public:
         return get() != nullptr; 
     }
 
+    std::size_t use_count() const noexcept {
+        return cb ? cb->strong.load() : 0;
+    }
+
     void reset() noexcept { release(); }
 
     void reset(T* p) {
-        release();
-        if (p) cb = new ControlBlock(p, Deleter{});
+        reset(p, std::default_delete<T>());
     }
 
+    template<typename Deleter>
     void reset(T* p, Deleter d) {
         release();
-        if (p) cb = new ControlBlock(p, std::move(d));
+        if (p) {
+            cb = new PointerBlock<Deleter>(p, std::move(d));
+            ptr = p;
+        }
+    }
+};
+
+// Non-owning reference to an object managed by shared_ptr. It keeps the
+// control block alive but not the object; lock() yields a shared_ptr while
+// the object still exists and an empty one afterwards.
+template<typename T, typename Policy = multi_threaded>
+class weak_ptr {
+private:
+    using ControlBlock = detail::ControlBlockBase<Policy>;
+
+    T* ptr;
+    ControlBlock* cb;
+
+    void release() noexcept {
+        if (cb && cb->weak.decrement())
+            cb->destroy();
+        ptr = nullptr;
+        cb = nullptr;
+    }
+
+public:
+    weak_ptr() noexcept : ptr(nullptr), cb(nullptr) {}
+
+    weak_ptr(const shared_ptr<T, Policy>& other) noexcept : ptr(other.ptr), cb(other.cb) {
+        if (cb)
+            cb->weak.increment();
+    }
+
+    weak_ptr(const weak_ptr& other) noexcept : ptr(other.ptr), cb(other.cb) {
+        if (cb)
+            cb->weak.increment();
+    }
+
+    weak_ptr(weak_ptr&& other) noexcept : ptr(other.ptr), cb(other.cb) {
+        other.ptr = nullptr;
+        other.cb = nullptr;
+    }
+
+    weak_ptr& operator=(const weak_ptr& other) noexcept {
+        if (this != &other) {
+            release();
+            ptr = other.ptr;
+            cb = other.cb;
+            if (cb)
+                cb->weak.increment();
+        }
+        return *this;
+    }
+
+    weak_ptr& operator=(weak_ptr&& other) noexcept {
+        if (this != &other) {
+            release();
+            ptr = other.ptr;
+            cb = other.cb;
+            other.ptr = nullptr;
+            other.cb = nullptr;
+        }
+        return *this;
+    }
+
+    weak_ptr& operator=(const shared_ptr<T, Policy>& other) noexcept {
+        return *this = weak_ptr(other);
+    }
+
+    ~weak_ptr() {
+        release();
+    }
+
+    void reset() noexcept { release(); }
+
+    std::size_t use_count() const noexcept {
+        return cb ? cb->strong.load() : 0;
+    }
+
+    bool expired() const noexcept {
+        return use_count() == 0;
+    }
+
+    shared_ptr<T, Policy> lock() const noexcept {
+        if (cb && cb->strong.try_increment())
+            return shared_ptr<T, Policy>(cb, ptr);
+        return shared_ptr<T, Policy>();
+    }
+};
+
+// Builds the object inside its control block with one allocation from alloc.
+template<typename T, typename Policy, typename Alloc, typename... Args>
+shared_ptr<T, Policy> allocate_shared(const Alloc& alloc, Args&&... args) {
+    using Block = detail::InlineBlock<T, Alloc, Policy>;
+    using BlockAlloc = typename Block::BlockAlloc;
+
+    BlockAlloc blockAlloc(alloc);
+    Block* block = std::allocator_traits<BlockAlloc>::allocate(blockAlloc, 1);
+    try {
+        ::new (static_cast<void*>(block)) Block(alloc, std::forward<Args>(args)...);
+    } catch (...) {
+        std::allocator_traits<BlockAlloc>::deallocate(blockAlloc, block, 1);
+        throw;
+    }
+
+    return shared_ptr<T, Policy>(static_cast<detail::ControlBlockBase<Policy>*>(block), block->value());
+}
+
+template<typename T, typename Policy = multi_threaded, typename... Args>
+shared_ptr<T, Policy> make_shared(Args&&... args) {
+    return my::allocate_shared<T, Policy>(std::allocator<T>(), std::forward<Args>(args)...);
+}
+
+// The deleter p was created with, or nullptr if it is not a Deleter.
+template<typename Deleter, typename T, typename Policy>
+Deleter* get_deleter(const shared_ptr<T, Policy>& p) noexcept {
+    return p.cb ? static_cast<Deleter*>(p.cb->deleter(typeid(Deleter))) : nullptr;
+}
+
+// Lock-free shared_ptr slot for publishing snapshots to many readers. The
+// slot is one 64-bit word: the control block address in the low 48 bits, a
+// 12-bit tag bumped on every store, and a local count of in-flight loads in
+// the top 8 bits. The tag lives in the 4 low address bits (blocks are
+// 16-byte aligned) and in bits 48-55, so control blocks must sit below 2^48
+// as on x86-64 and AArch64 with 4-level paging and no pointer tagging;
+// storing a pointer with any higher bit set asserts. load() reserves a
+// reference by bumping the local count in the same atomic operation that
+// reads the pointer, takes a real strong reference, then returns the
+// reservation. A store that swaps the block out first moves the outstanding
+// local count onto the block's strong count, so a reservation never refers
+// to a block that has already been freed; the tag keeps a reader from
+// handing a reservation back to a later install of the same block unless it
+// stalls across 4096 stores. When 255 loads are already in flight, further
+// loads wait for one to finish.
+//
+// Every load() writes the slot's word twice and the block's strong count
+// once, so concurrent load() callers contend on those cache lines and do not
+// scale with cores. Readers that poll a slot should each keep a
+// snapshot_cache instead.
+template<typename T>
+class atomic_shared_ptr {
+public:
+    using pointer_type = shared_ptr<T, multi_threaded>;
+
+    atomic_shared_ptr() noexcept : word(0) {}
+
+    explicit atomic_shared_ptr(pointer_type desired) noexcept : word(pack(take(desired), 0)) {}
+
+    atomic_shared_ptr(const atomic_shared_ptr&) = delete;
+    atomic_shared_ptr& operator=(const atomic_shared_ptr&) = delete;
+
+    ~atomic_shared_ptr() {
+        adopt(word.load(std::memory_order_acquire));
+    }
+
+    pointer_type load() const noexcept {
+        std::uint64_t reserved = word.load(std::memory_order_relaxed);
+        for (;;) {
+            if ((reserved >> countShift) == countMax) {
+                std::this_thread::yield();
+                reserved = word.load(std::memory_order_relaxed);
+            } else if (word.compare_exchange_weak(reserved, reserved + localOne, std::memory_order_acquire,
+                                                  std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        ControlBlock* cb = block(reserved);
+        if (cb)
+            cb->strong.increment();
+
+        // Give the reservation back while the same install is still current;
+        // otherwise the store that replaced it already paid for it.
+        std::uint64_t current = word.load(std::memory_order_relaxed);
+        while ((current & installMask) == (reserved & installMask)) {
+            if (word.compare_exchange_weak(current, current - localOne, std::memory_order_relaxed))
+                return wrap(cb);
+        }
+        if (cb)
+            cb->strong.decrement();
+
+        return wrap(cb);
+    }
+
+    void store(pointer_type desired) noexcept {
+        exchange(std::move(desired));
+    }
+
+    pointer_type exchange(pointer_type desired) noexcept {
+        ControlBlock* cb = take(desired);
+        std::uint64_t old = word.load(std::memory_order_relaxed);
+        while (!word.compare_exchange_weak(old, pack(cb, tag(old) + 1), std::memory_order_acq_rel))
+            ;
+        return adopt(old);
+    }
+
+    // Replaces the stored pointer with desired if it still manages the same
+    // object as expected; otherwise loads the current value into expected.
+    bool compare_exchange(pointer_type& expected, pointer_type desired) noexcept {
+        std::uint64_t current = word.load(std::memory_order_relaxed);
+        while (block(current) == expected.cb) {
+            if (word.compare_exchange_weak(current, pack(desired.cb, tag(current) + 1), std::memory_order_acq_rel)) {
+                take(desired);
+                adopt(current);
+                return true;
+            }
+        }
+
+        expected = load();
+        return false;
+    }
+
+private:
+    using ControlBlock = detail::ControlBlockBase<multi_threaded>;
+
+    static constexpr int addressBits = 48;
+    static constexpr int lowTagBits = 4;
+    static constexpr int highTagBits = 8;
+    static constexpr int countShift = addressBits + highTagBits;
+
+    static constexpr std::uint64_t addressMask = (std::uint64_t(1) << addressBits) - 1;
+    static constexpr std::uint64_t lowTagMask = (std::uint64_t(1) << lowTagBits) - 1;
+    static constexpr std::uint64_t highTagMask = (std::uint64_t(1) << highTagBits) - 1;
+    static constexpr std::uint64_t localOne = std::uint64_t(1) << countShift;
+    static constexpr std::uint64_t countMax = (~std::uint64_t(0)) >> countShift;
+    static constexpr std::uint64_t installMask = localOne - 1;    // address and tag
+
+    static_assert(sizeof(void*) == 8, "atomic_shared_ptr packs pointers into 48 bits");
+    static_assert(alignof(ControlBlock) >= (1 << lowTagBits), "Control blocks must leave room for the tag");
+
+    mutable std::atomic<std::uint64_t> word;
+
+    static ControlBlock* block(std::uint64_t w) noexcept {
+        return reinterpret_cast<ControlBlock*>(w & addressMask & ~lowTagMask);
+    }
+
+    static std::uint64_t tag(std::uint64_t w) noexcept {
+        return (w & lowTagMask) | (((w >> addressBits) & highTagMask) << lowTagBits);
+    }
+
+    static std::uint64_t pack(ControlBlock* cb, std::uint64_t t) noexcept {
+        assert((reinterpret_cast<std::uintptr_t>(cb) & ~addressMask) == 0 && "Control block above 2^48");
+        return reinterpret_cast<std::uint64_t>(cb) | (t & lowTagMask)
+             | (((t >> lowTagBits) & highTagMask) << addressBits);
+    }
+
+    static pointer_type wrap(ControlBlock* cb) noexcept {
+        return cb ? pointer_type(cb, static_cast<T*>(cb->object())) : pointer_type();
+    }
+
+    template<typename U>
+    friend class snapshot_cache;
+
+    bool holds(const pointer_type& p) const noexcept {
+        return block(word.load(std::memory_order_acquire)) == p.cb;
+    }
+
+    // Moves desired's strong reference into the slot.
+    static ControlBlock* take(pointer_type& desired) noexcept {
+        ControlBlock* cb = desired.cb;
+        desired.ptr = nullptr;
+        desired.cb = nullptr;
+        return cb;
+    }
+
+    // Turns a word that was swapped out into an owning shared_ptr, first
+    // settling the reservations of loads still in flight.
+    static pointer_type adopt(std::uint64_t old) noexcept {
+        ControlBlock* cb = block(old);
+        if (!cb)
+            return pointer_type();
+        if (std::uint64_t pending = old >> countShift)
+            cb->strong.add(static_cast<std::size_t>(pending));
+        return wrap(cb);
+    }
+};
+
+// One reader's cached view of an atomic_shared_ptr. get() only reads the
+// slot's word while the cached snapshot is still installed and calls load()
+// after a store has replaced it, so readers that each keep a cache share the
+// word's cache line instead of writing it and scale with cores. The cache
+// keeps its block alive, so a matching address cannot belong to another
+// block. Not thread-safe itself: give each reader its own.
+template<typename T>
+class snapshot_cache {
+public:
+    using pointer_type = typename atomic_shared_ptr<T>::pointer_type;
+
+    explicit snapshot_cache(const atomic_shared_ptr<T>& slot) : slot(&slot), current(slot.load()) {}
+
+    const pointer_type& get() noexcept {
+        if (!slot->holds(current))
+            current = slot->load();
+        return current;
+    }
+
+private:
+    const atomic_shared_ptr<T>* slot;
+    pointer_type current;
+};
+
+// CRTP base that keeps the reference count, and the deleter, inside the
+// object itself: struct Message : my::ref_counted<Message> { ... }. Copying
+// an object does not copy its count.
+template<typename Derived, typename Deleter = std::default_delete<Derived>, typename Policy = multi_threaded>
+class ref_counted : private detail::Compressed<Deleter> {
+public:
+    std::size_t use_count() const noexcept { return refs.load(); }
+
+protected:
+    explicit ref_counted(Deleter d = Deleter()) : detail::Compressed<Deleter>(std::move(d)), refs(0) {}
+
+    ref_counted(const ref_counted& other) : detail::Compressed<Deleter>(other), refs(0) {}
+
+    ref_counted& operator=(const ref_counted&) noexcept { return *this; }
+
+    ~ref_counted() = default;
+
+private:
+    mutable typename Policy::counter refs;
+
+    friend void intrusive_add_ref(const ref_counted* p) noexcept {
+        p->refs.increment();
+    }
+
+    // The deleter is moved out first, since deleting the object destroys it.
+    friend void intrusive_release(const ref_counted* p) noexcept {
+        if (p->refs.decrement()) {
+            auto* self = const_cast<ref_counted*>(p);
+            Deleter d = std::move(self->get());
+            d(static_cast<Derived*>(self));
+        }
+    }
+};
+
+// Single-word owning pointer to an object that counts its own references.
+// Found by argument-dependent lookup, intrusive_add_ref(T*) and
+// intrusive_release(T*) do the counting; ref_counted provides both, and
+// other types may define their own.
+template<typename T>
+class intrusive_ptr {
+private:
+    T* ptr;
+
+public:
+    intrusive_ptr() noexcept : ptr(nullptr) {}
+
+    // With add_ref == false the pointer adopts a reference the caller already
+    // holds, e.g. one returned by detach().
+    intrusive_ptr(T* p, bool add_ref = true) noexcept : ptr(p) {
+        if (ptr && add_ref)
+            intrusive_add_ref(ptr);
+    }
+
+    intrusive_ptr(const intrusive_ptr& other) noexcept : ptr(other.ptr) {
+        if (ptr)
+            intrusive_add_ref(ptr);
+    }
+
+    intrusive_ptr(intrusive_ptr&& other) noexcept : ptr(other.ptr) {
+        other.ptr = nullptr;
+    }
+
+    intrusive_ptr& operator=(const intrusive_ptr& other) noexcept {
+        intrusive_ptr(other).swap(*this);
+        return *this;
+    }
+
+    intrusive_ptr& operator=(intrusive_ptr&& other) noexcept {
+        intrusive_ptr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    ~intrusive_ptr() {
+        if (ptr)
+            intrusive_release(ptr);
+    }
+
+    T* get() const noexcept { 
+        return ptr; 
+    }
+
+    T& operator*() const noexcept { 
+        return *ptr; 
+    }
+
+    T* operator->() const noexcept { 
+        return ptr; 
     }
+
+    explicit operator bool() const noexcept { 
+        return ptr != nullptr; 
+    }
+
+    void reset() noexcept { intrusive_ptr().swap(*this); }
+
+    void reset(T* p) noexcept { intrusive_ptr(p).swap(*this); }
+
+    // Gives up ownership without releasing the reference.
+    T* detach() noexcept {
+        T* p = ptr;
+        ptr = nullptr;
+        return p;
+    }
+
+    void swap(intrusive_ptr& other) noexcept {
+        std::swap(ptr, other.ptr);
+    }
+};
+
+// Deleter that drops one intrusive reference. A shared_ptr built with it
+// owns a reference of an intrusively counted object, which lets code still
+// taking my::shared_ptr share objects with code already on intrusive_ptr.
+struct intrusive_deleter {
+    template<typename T>
+    void operator()(T* p) const noexcept { intrusive_release(p); }
 };
 
+template<typename T, typename Policy = multi_threaded>
+shared_ptr<T, Policy> to_shared(intrusive_ptr<T> p) {
+    T* raw = p.get();
+    shared_ptr<T, Policy> result(raw, intrusive_deleter());
+    p.detach();
+    return result;
+}
+
+// Only shared_ptrs made by to_shared() convert back; for any other owner the
+// result is empty, because the object's intrusive count does not own it.
+template<typename T, typename Policy>
+intrusive_ptr<T> to_intrusive(const shared_ptr<T, Policy>& p) noexcept {
+    if (!get_deleter<intrusive_deleter>(p))
+        return intrusive_ptr<T>();
+    return intrusive_ptr<T>(p.get());
+}
+
 } // namespace my
 
 struct Test {
@@ -135,6 +1344,32 @@ struct StatefulDeleter {
     }
 };
 
+struct Message : my::ref_counted<Message> {
+    int id;
+    Message(int id) : id(id) {
+        cout << "Message " << id << " created\n";
+    }
+
+    ~Message() {
+        cout << "Message " << id << " destroyed\n";
+    }
+};
+
+struct Packet;
+void packet_deleter(Packet* p);
+
+struct Packet : my::ref_counted<Packet, void(*)(Packet*), my::single_threaded> {
+    int id;
+    Packet(int id) : ref_counted(packet_deleter), id(id) {
+        cout << "Packet " << id << " created\n";
+    }
+};
+
+void packet_deleter(Packet* p) {
+    cout << "Custom deleter for Packet " << p->id << "\n";
+    delete p;
+}
+
 int main() {
     cout << "--- Test 1: Default deleter ---\n";
     {
@@ -145,7 +1380,7 @@ int main() {
 
     cout << "--- Test 2: C-style function deleter ---\n";
     {
-        my::shared_ptr<Test, void(*)(Test*)> p3(new Test(2), custom_deleter);
+        my::shared_ptr<Test> p3(new Test(2), custom_deleter);
         auto p4 = p3;
     }
     cout << "\n";
@@ -156,14 +1391,14 @@ int main() {
             cout << "Lambda deleter for Test " << p->id << "\n";
             delete p;
         };
-        my::shared_ptr<Test, decltype(lambda)> p5(new Test(3), lambda);
+        my::shared_ptr<Test> p5(new Test(3), lambda);
     }
     cout << "\n";
 
     cout << "--- Test 4: Stateful functor deleter ---\n";
     {
         StatefulDeleter sd("Stateful deleter for");
-        my::shared_ptr<Test, StatefulDeleter> p6(new Test(4), sd);
+        my::shared_ptr<Test> p6(new Test(4), sd);
     }
     cout << "\n";
 
@@ -173,7 +1408,345 @@ int main() {
             cout << "std::function deleter for Test " << p->id << "\n";
             delete p;
         };
-        my::shared_ptr<Test, function<void(Test*)>> p7(new Test(5), func);
+        my::shared_ptr<Test> p7(new Test(5), func);
+    }
+    cout << "\n";
+
+    cout << "--- Test 6: Single-threaded counting policy ---\n";
+    {
+        my::shared_ptr<Test, my::single_threaded> p8(new Test(6));
+        auto p9 = p8;
+        cout << "use_count: " << p9.use_count() << "\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 7: Copies shared across threads ---\n";
+    {
+        my::shared_ptr<Test> p10(new Test(7));
+        vector<thread> workers;
+        for (int t = 0; t < 4; ++t) {
+            workers.emplace_back([p10] {
+                for (int i = 0; i < 100000; ++i) {
+                    auto copy = p10;
+                    auto moved = std::move(copy);
+                }
+            });
+        }
+        for (auto& w : workers)
+            w.join();
+        cout << "use_count after join: " << p10.use_count() << "\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 8: Contended copies vs std::shared_ptr ---\n";
+    {
+        const int threads = 4, copies = 1000000;
+
+        auto bench = [&](auto ptr) {
+            auto start = chrono::steady_clock::now();
+            vector<thread> workers;
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([ptr] {
+                    for (int i = 0; i < copies; ++i) {
+                        auto copy = ptr;
+                        (void)copy;
+                    }
+                });
+            }
+            for (auto& w : workers)
+                w.join();
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        };
+
+        cout << "my::shared_ptr (multi_threaded):  " << bench(my::shared_ptr<int>(new int(8))) << " ms\n";
+        cout << "my::shared_ptr (single_threaded), one thread: ";
+        {
+            my::shared_ptr<int, my::single_threaded> p(new int(8));
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < threads * copies; ++i) {
+                auto copy = p;
+                (void)copy;
+            }
+            cout << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n";
+        }
+        cout << "std::shared_ptr:                  " << bench(std::make_shared<int>(8)) << " ms\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 9: make_shared and allocate_shared ---\n";
+    {
+        auto p11 = my::make_shared<Test>(9);
+        auto p12 = p11;
+        cout << "use_count: " << p12.use_count() << "\n";
+
+        auto p13 = my::allocate_shared<Test>(allocator<Test>(), 10);
+    }
+    cout << "\n";
+
+    cout << "--- Test 10: weak_ptr with a custom deleter ---\n";
+    {
+        my::weak_ptr<Test> w;
+        {
+            my::shared_ptr<Test> p14(new Test(11), custom_deleter);
+            w = p14;
+            if (auto locked = w.lock())
+                cout << "lock() while owned: Test " << locked->id << ", use_count " << w.use_count() << "\n";
+        }
+        cout << "expired after last owner: " << boolalpha << w.expired() << noboolalpha << "\n";
+        cout << "lock() after expiry is empty: " << boolalpha << !w.lock() << noboolalpha << "\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 11: Pooled control blocks ---\n";
+    {
+        const int objects = 1000000;
+        my::pool_stats before = my::block_pool_stats();
+
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < objects; ++i)
+            my::shared_ptr<int> p(new int(i));
+        double pooled = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        vector<my::shared_ptr<int>> handoff;
+        for (int i = 0; i < 1000; ++i)
+            handoff.emplace_back(new int(i));
+        thread([moved = std::move(handoff)]() mutable { moved.clear(); }).join();
+
+        my::pool_stats after = my::block_pool_stats();
+        cout << "churn of " << objects << " shared_ptrs: " << pooled << " ms"
+             << (my::block_pool_enabled() ? "" : " (pool disabled)") << "\n";
+        cout << "hits: " << after.hits - before.hits << ", misses: " << after.misses - before.misses
+             << ", live: " << after.live << "\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 12: atomic_shared_ptr snapshots vs mutex ---\n";
+    {
+        struct Snapshot {
+            int version;
+            vector<int> routes;
+        };
+
+        my::atomic_shared_ptr<Snapshot> current(my::make_shared<Snapshot>(Snapshot{0, vector<int>(64, 0)}));
+        mutex lock;
+        my::shared_ptr<Snapshot> guarded = current.load();
+
+        enum class Read { load, cache, mutex };
+
+        // Readers pull snapshots for a fixed time while one writer publishes
+        // a new version every 100 microseconds; returns loads per second.
+        auto run = [&](int readers, Read how) {
+            atomic_bool stop{false};
+            atomic<long long> loads{0};
+            vector<thread> threads;
+
+            for (int r = 0; r < readers; ++r) {
+                threads.emplace_back([&] {
+                    my::snapshot_cache<Snapshot> cache(current);
+                    long long n = 0;
+                    while (!stop.load(memory_order_relaxed)) {
+                        my::shared_ptr<Snapshot> snap;
+                        size_t routes;
+                        if (how == Read::load) {
+                            snap = current.load();
+                            routes = snap->routes.size();
+                        } else if (how == Read::cache) {
+                            routes = cache.get()->routes.size();
+                        } else {
+                            lock_guard<mutex> hold(lock);
+                            snap = guarded;
+                            routes = snap->routes.size();
+                        }
+                        if (routes != 64)
+                            cout << "torn snapshot\n";
+                        ++n;
+                    }
+                    loads += n;
+                });
+            }
+
+            thread writer([&] {
+                for (int v = 1; !stop.load(memory_order_relaxed); ++v) {
+                    auto next = my::make_shared<Snapshot>(Snapshot{v, vector<int>(64, v)});
+                    if (how == Read::mutex) {
+                        lock_guard<mutex> hold(lock);
+                        guarded = next;
+                    } else {
+                        current.store(next);
+                    }
+                    this_thread::sleep_for(chrono::microseconds(100));
+                }
+            });
+
+            this_thread::sleep_for(chrono::milliseconds(200));
+            stop = true;
+            for (auto& t : threads)
+                t.join();
+            writer.join();
+            return loads.load() * 5;
+        };
+
+        for (int readers : {1, 2, 4}) {
+            cout << readers << " reader(s): load() " << run(readers, Read::load) << " loads/s, snapshot_cache "
+                 << run(readers, Read::cache) << " loads/s, mutex " << run(readers, Read::mutex) << " loads/s\n";
+        }
+
+        auto expected = current.load();
+        bool swapped = current.compare_exchange(expected, my::make_shared<Snapshot>(Snapshot{-1, {}}));
+        cout << "compare_exchange with the current snapshot: " << boolalpha << swapped << noboolalpha
+             << ", version now " << current.load()->version << "\n";
+    }
+    {
+        // Three readers load while two writers store, exchange and
+        // compare_exchange, sometimes installing null. Every snapshot must be
+        // destroyed exactly once, and never while a reader still holds it.
+        constexpr int published = 20000;
+        vector<atomic<int>> deaths(published);
+        atomic<int> nextId{0};
+        atomic<long long> early{0};
+
+        struct Tracked {
+            Tracked(int id, vector<atomic<int>>* deaths) : id(id), deaths(deaths) {}
+            Tracked(const Tracked&) = delete;
+            ~Tracked() { (*deaths)[id].fetch_add(1, memory_order_relaxed); }
+
+            int id;
+            vector<atomic<int>>* deaths;
+        };
+
+        my::atomic_shared_ptr<Tracked> slot;
+        atomic_bool done{false};
+
+        vector<thread> readers;
+        for (int r = 0; r < 3; ++r) {
+            readers.emplace_back([&] {
+                my::snapshot_cache<Tracked> cache(slot);
+                while (!done.load(memory_order_acquire)) {
+                    auto snap = slot.load();
+                    if (snap && deaths[snap->id].load(memory_order_relaxed) != 0)
+                        ++early;
+                    const auto& cached = cache.get();
+                    if (cached && deaths[cached->id].load(memory_order_relaxed) != 0)
+                        ++early;
+                }
+            });
+        }
+
+        vector<thread> writers;
+        for (int w = 0; w < 2; ++w) {
+            writers.emplace_back([&] {
+                for (int i = 0;; ++i) {
+                    if (i % 4 == 3) {
+                        slot.store(nullptr);
+                        continue;
+                    }
+                    int id = nextId.fetch_add(1);
+                    if (id >= published)
+                        return;
+                    auto next = my::make_shared<Tracked>(id, &deaths);
+                    if (i % 4 == 0) {
+                        slot.store(move(next));
+                    } else if (i % 4 == 1) {
+                        slot.exchange(move(next));
+                    } else {
+                        auto expected = slot.load();
+                        slot.compare_exchange(expected, move(next));
+                    }
+                }
+            });
+        }
+
+        for (auto& t : writers)
+            t.join();
+        done = true;
+        for (auto& t : readers)
+            t.join();
+        slot.store(nullptr);
+
+        bool exactlyOnce = all_of(deaths.begin(), deaths.end(), [](const atomic<int>& d) { return d.load() == 1; });
+        cout << "3 readers, 2 writers: " << published << " snapshots each destroyed exactly once: " << boolalpha
+             << exactlyOnce << ", seen after destruction: " << early.load() << noboolalpha << "\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 13: intrusive_ptr ---\n";
+    {
+        my::intrusive_ptr<Message> m1(new Message(13));
+        auto m2 = m1;
+        cout << "use_count: " << m1->use_count() << ", sizeof(intrusive_ptr): " << sizeof(m1) << "\n";
+
+        my::intrusive_ptr<Packet> packet(new Packet(14));
+
+        auto legacy = my::to_shared(m2);
+        cout << "through shared_ptr: Message " << legacy->id << ", use_count " << m1->use_count() << "\n";
+        my::intrusive_ptr<Message> back = my::to_intrusive(legacy);
+        cout << "back to intrusive_ptr: use_count " << back->use_count() << "\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 14: One shared_ptr type for every deleter ---\n";
+    {
+        vector<my::shared_ptr<Test>> mixed;
+        mixed.emplace_back(new Test(15));
+        mixed.emplace_back(new Test(16), custom_deleter);
+        mixed.emplace_back(new Test(17), StatefulDeleter("Stateful deleter for"));
+        cout << "function deleter found: " << boolalpha
+             << (my::get_deleter<void(*)(Test*)>(mixed[1]) != nullptr) << ", on a default-deleted pointer: "
+             << (my::get_deleter<void(*)(Test*)>(mixed[0]) != nullptr) << noboolalpha << "\n";
+    }
+    cout << "\n";
+
+    cout << "--- Test 15: Deferred reclamation ---\n";
+    {
+        struct Node {
+            int id;
+            vector<my::shared_ptr<Node>> children;
+        };
+
+        // Each request builds a 4096-node graph and times only the moment its
+        // last reference goes away.
+        auto run = [](bool deferredMode) {
+            vector<double> micros;
+            for (int request = 0; request < 200; ++request) {
+                auto root = my::make_shared<Node>(Node{request, {}});
+                root->children.reserve(4096);
+                for (int i = 0; i < 4096; ++i)
+                    root->children.push_back(my::make_shared<Node>(Node{i, {}}));
+
+                optional<my::deferred::scope> defer;
+                if (deferredMode)
+                    defer.emplace();
+                auto start = chrono::steady_clock::now();
+                root.reset();
+                micros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+            }
+            sort(micros.begin(), micros.end());
+            return make_pair(micros[micros.size() / 2], micros[micros.size() * 99 / 100]);
+        };
+
+        auto inlineRelease = run(false);
+        my::deferred::start_reclaimer();
+        auto deferredRelease = run(true);
+        my::deferred::stop_reclaimer();
+        my::deferred::drain();
+
+        auto stats = my::deferred::stats();
+        cout << "inline release:   p50 " << inlineRelease.first << " us, p99 " << inlineRelease.second << " us\n";
+        cout << "deferred release: p50 " << deferredRelease.first << " us, p99 " << deferredRelease.second << " us\n";
+        cout << "reclaimed " << stats.reclaimed << ", still queued " << stats.pending << ", lag max "
+             << stats.maxLagMs << " ms, mean " << stats.meanLagMs << " ms\n";
+
+        // Draining from inside a scope also reclaims what the drained blocks
+        // release in turn.
+        {
+            my::deferred::scope defer;
+            auto root = my::make_shared<Node>(Node{0, {}});
+            for (int i = 0; i < 1000; ++i)
+                root->children.push_back(my::make_shared<Node>(Node{i, {}}));
+            root.reset();
+            my::deferred::drain();
+            cout << "drain inside a scope leaves " << my::deferred::stats().pending << " queued\n";
+        }
     }
     cout << "\n";
 
@@ -1,115 +1,271 @@
 #include <cstring>
+#include <cstdlib>
+#include <cstdint>
 #include <stdexcept>
 #include <utility>
 #include <iostream>
+#include <iomanip>
 #include <string>
+#include <vector>
+#include <random>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <chrono>
+#include <type_traits>
+#include <algorithm>
 #include <cassert>
 
 using namespace std;
 
-class SmallString {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "SmallString keeps its mode flag in the top byte of the capacity word, which must be the last byte"
+#endif
+
+// Bump-pointer region for request-scoped strings. Allocations are carved from
+// chunks and never freed individually; release() (or the destructor) drops
+// them all at once.
+class Arena {
 public:
-  static constexpr size_t ssoThreshold = 15;
+  static constexpr size_t defaultChunkSize = 64 * 1024;
+
+  explicit Arena(size_t chunkSize = defaultChunkSize) noexcept
+    : chunkSize(chunkSize) {}
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
 
-  SmallString() noexcept
-    : size(0), capacity(ssoThreshold), isSmall(true) {
-    data.small[0] = '\0';
+  ~Arena() {
+    release();
   }
 
-  SmallString(const char* s) {
+  void* allocate(size_t bytes, size_t alignment = alignof(max_align_t)) {
 
-    size_t len = strlen(s);
+    size_t offset = (used + alignment - 1) & ~(alignment - 1);
+    if (!chunks.empty() && offset + bytes <= chunks.back().size) {
+      used = offset + bytes;
+      return chunks.back().data + offset;
+    }
 
-    if (len <= ssoThreshold) {
-      isSmall = true;
-      capacity = ssoThreshold;
-      memcpy(data.small, s, len + 1);
-    } else {
-      isSmall = false;
-      capacity = len;
-      data.ptr = new char[capacity + 1];
-      memcpy(data.ptr, s, len + 1);
+    // Oversized requests get a chunk of their own so the current one keeps
+    // serving small strings.
+    size_t size = max(bytes, chunkSize);
+    char* data = static_cast<char*>(::operator new(size));
+    if (size > chunkSize && !chunks.empty()) {
+      chunks.insert(chunks.end() - 1, Chunk{data, size});
+      return data;
     }
 
-    size = len;
+    chunks.push_back(Chunk{data, size});
+    used = bytes;
+    return data;
   }
 
-  SmallString(const SmallString& other) {
+  void release() noexcept {
+    for (Chunk& chunk : chunks) ::operator delete(chunk.data);
+    chunks.clear();
+    used = 0;
+  }
+
+  size_t bytesReserved() const noexcept {
+    size_t total = 0;
+    for (const Chunk& chunk : chunks) total += chunk.size;
+    return total;
+  }
+
+private:
+  struct Chunk {
+    char*  data;
+    size_t size;
+  };
+
+  size_t chunkSize;
+  size_t used = 0;
+  vector<Chunk> chunks;
+};
+
+// Standard allocator over an Arena; deallocate is a no-op.
+template<typename T>
+class ArenaAllocator {
+public:
+  using value_type = T;
+
+  ArenaAllocator(Arena& arena) noexcept
+    : arena(&arena) {}
+
+  template<typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+    : arena(other.arena) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
 
-    size = other.size;
-    capacity = other.capacity;
-    isSmall = other.isSmall;
+  void deallocate(T*, size_t) noexcept {}
 
-    if (isSmall) {
-      memcpy(data.small, other.data.small, size + 1);
+  template<typename U>
+  bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena == other.arena; }
+
+  template<typename U>
+  bool operator!=(const ArenaAllocator<U>& other) const noexcept { return arena != other.arena; }
+
+private:
+  template<typename U> friend class ArenaAllocator;
+
+  Arena* arena;
+};
+
+// 24-byte string. Short strings live inline in all 24 bytes; the last byte
+// holds ssoThreshold - size, so it doubles as the terminator of a full
+// 23-character string. Long strings store pointer, size and capacity, with
+// the top bit of the capacity word (the same last byte) marking heap mode.
+// The allocator is a private base, so a stateless one adds no bytes.
+template<typename Alloc = allocator<char>>
+class BasicSmallString : private Alloc {
+  static_assert(is_same<typename Alloc::value_type, char>::value, "BasicSmallString allocates chars");
+
+  using Traits = allocator_traits<Alloc>;
+
+public:
+  static constexpr size_t ssoThreshold = 23;
+
+  BasicSmallString() noexcept(noexcept(Alloc()))
+    : Alloc() {
+    setSmallSize(0);
+  }
+
+  explicit BasicSmallString(const Alloc& alloc) noexcept
+    : Alloc(alloc) {
+    setSmallSize(0);
+  }
+
+  BasicSmallString(const char* s, const Alloc& alloc = Alloc())
+    : Alloc(alloc) {
+
+    size_t len = strlen(s);
+
+    if (len <= ssoThreshold) {
+      memcpy(repr.small, s, len);
+      setSmallSize(len);
     } else {
-      data.ptr = new char[capacity + 1];
-      memcpy(data.ptr, other.data.ptr, size + 1);
+      repr.heap.ptr = Traits::allocate(allocRef(), len + 1);
+      memcpy(repr.heap.ptr, s, len + 1);
+      repr.heap.size = len;
+      setHeapCapacity(len);
     }
 
   }
 
-  SmallString(SmallString&& other) noexcept
-    : size(other.size), capacity(other.capacity), isSmall(other.isSmall) {
+  BasicSmallString(const BasicSmallString& other)
+    : Alloc(Traits::select_on_container_copy_construction(other.allocRef())) {
 
-    if (isSmall) {
-      memcpy(data.small, other.data.small, size + 1);
+    if (other.isSmall()) {
+      memcpy(&repr, &other.repr, sizeof(Repr));
     } else {
-      data.ptr = other.data.ptr;
-      other.data.ptr = nullptr;
+      size_t len = other.repr.heap.size;
+      repr.heap.ptr = Traits::allocate(allocRef(), len + 1);
+      memcpy(repr.heap.ptr, other.repr.heap.ptr, len + 1);
+      repr.heap.size = len;
+      setHeapCapacity(len);
     }
 
-    other.size = 0;
-    other.capacity = ssoThreshold;
-    other.isSmall = true;
-    other.data.small[0] = '\0';
+  }
 
+  BasicSmallString(BasicSmallString&& other) noexcept
+    : Alloc(move(other.allocRef())) {
+    memcpy(&repr, &other.repr, sizeof(Repr));
+    other.setSmallSize(0);
   }
 
-  ~SmallString() {
-    if (!isSmall && data.ptr) delete[] data.ptr;
+  ~BasicSmallString() {
+    if (!isSmall()) Traits::deallocate(allocRef(), repr.heap.ptr, getCapacity() + 1);
   }
 
-  SmallString& operator=(SmallString other) noexcept {
-    swap(other);
+  // Assignment keeps this string's allocator unless the allocator asks to
+  // propagate; otherwise the characters are copied into storage from our own
+  // allocator, since the source's buffer may not outlive it.
+  BasicSmallString& operator=(const BasicSmallString& other) {
+
+    if (this == &other) return *this;
+
+    if constexpr (Traits::propagate_on_container_copy_assignment::value) {
+      if (allocRef() != other.allocRef()) freeStorage();
+      allocRef() = other.allocRef();
+    }
+    assign(other.rawData(), other.getSize());
     return *this;
+
   }
 
-  size_t getSize() const noexcept { 
-    return size; 
+  BasicSmallString& operator=(BasicSmallString&& other)
+      noexcept(Traits::propagate_on_container_move_assignment::value || Traits::is_always_equal::value) {
+
+    if (this == &other) return *this;
+
+    if constexpr (!Traits::propagate_on_container_move_assignment::value) {
+      if (allocRef() != other.allocRef()) {
+        assign(other.rawData(), other.getSize());
+        return *this;
+      }
+    }
+
+    freeStorage();
+    if constexpr (Traits::propagate_on_container_move_assignment::value) allocRef() = move(other.allocRef());
+    memcpy(&repr, &other.repr, sizeof(Repr));
+    other.setSmallSize(0);
+    return *this;
+
+  }
+
+  size_t getSize() const noexcept {
+    return isSmall() ? ssoThreshold - lastByte() : repr.heap.size;
+  }
+
+  size_t getCapacity() const noexcept {
+    return isSmall() ? ssoThreshold : repr.heap.capacity & ~heapFlag;
   }
 
-  size_t getCapacity() const noexcept { 
-    return capacity; 
+  Alloc getAllocator() const noexcept {
+    return allocRef();
   }
 
   void reserve(size_t newCap) {
 
+    size_t capacity = getCapacity();
     if (newCap <= capacity) return;
 
-    char* buf = new char[newCap + 1];
+    size_t size = getSize();
+    char* buf = Traits::allocate(allocRef(), newCap + 1);
     memcpy(buf, rawData(), size + 1);
 
-    if (!isSmall) delete[] data.ptr;
-    data.ptr = buf;
-    isSmall = false;
-    capacity = newCap;
+    if (!isSmall()) Traits::deallocate(allocRef(), repr.heap.ptr, capacity + 1);
+    repr.heap.ptr = buf;
+    repr.heap.size = size;
+    setHeapCapacity(newCap);
 
   }
 
   void pushBack(char c) {
 
+    size_t size = getSize();
+    size_t capacity = getCapacity();
     if (size + 1 > capacity) {
       reserve(capacity + capacity/2 + 1);
     }
-    char* p = rawData();
-    p[size++] = c;
-    p[size] = '\0';
+
+    if (isSmall()) {
+      repr.small[size] = c;
+      setSmallSize(size + 1);
+    } else {
+      repr.heap.ptr[size] = c;
+      repr.heap.ptr[size + 1] = '\0';
+      repr.heap.size = size + 1;
+    }
 
   }
 
   char& operator[](size_t idx) {
-    assert(idx < size);
+    assert(idx < getSize());
     return rawData()[idx];
   }
 
@@ -119,39 +275,363 @@ public:
 
 private:
 
-  size_t size;
-  size_t capacity;
-  bool   isSmall;
+  static constexpr size_t heapFlag = size_t(1) << (sizeof(size_t) * 8 - 1);
+  static constexpr unsigned char heapTag = 0x80;
+
+  union Repr {
+    char small[ssoThreshold + 1];
+    struct Heap {
+      char*  ptr;
+      size_t size;
+      size_t capacity;
+    } heap;
+  } repr;
+
+  // Read through memcpy so the tag can be inspected whichever member is active.
+  unsigned char lastByte() const noexcept {
+    unsigned char tag;
+    memcpy(&tag, reinterpret_cast<const char*>(&repr) + ssoThreshold, 1);
+    return tag;
+  }
 
-  union Data {
-    char* ptr;
-    char  small[ssoThreshold + 1];
-    Data(): ptr(nullptr) {}
-  } data;
+  bool isSmall() const noexcept {
+    return (lastByte() & heapTag) == 0;
+  }
+
+  void setSmallSize(size_t size) noexcept {
+    repr.small[size] = '\0';
+    repr.small[ssoThreshold] = static_cast<char>(ssoThreshold - size);
+  }
+
+  void setHeapCapacity(size_t capacity) noexcept {
+    repr.heap.capacity = capacity | heapFlag;
+  }
 
   char* rawData() noexcept {
-    return isSmall ? data.small : data.ptr;
+    return isSmall() ? repr.small : repr.heap.ptr;
   }
 
   const char* rawData() const noexcept {
-    return isSmall ? data.small : data.ptr;
+    return isSmall() ? repr.small : repr.heap.ptr;
+  }
+
+  Alloc& allocRef() noexcept {
+    return *this;
+  }
+
+  const Alloc& allocRef() const noexcept {
+    return *this;
   }
 
-  void swap(SmallString& other) noexcept {
+  void freeStorage() noexcept {
+    if (!isSmall()) Traits::deallocate(allocRef(), repr.heap.ptr, getCapacity() + 1);
+    setSmallSize(0);
+  }
 
-    std::swap(size, other.size);
-    std::swap(capacity, other.capacity);
-    std::swap(isSmall, other.isSmall);
+  // Replaces the contents, reusing the current buffer when it is big enough.
+  void assign(const char* s, size_t len) {
+
+    if (isSmall() && len <= ssoThreshold) {
+      memcpy(repr.small, s, len);
+      setSmallSize(len);
+      return;
+    }
+
+    if (len > getCapacity()) {
+      char* buf = Traits::allocate(allocRef(), len + 1);
+      freeStorage();
+      repr.heap.ptr = buf;
+      setHeapCapacity(len);
+    }
+
+    memcpy(repr.heap.ptr, s, len);
+    repr.heap.ptr[len] = '\0';
+    repr.heap.size = len;
 
-    Data tmp;
-    memcpy(&tmp, &data, sizeof(Data));
-    memcpy(&data, &other.data, sizeof(Data));
-    memcpy(&other.data, &tmp, sizeof(Data));
-    
   }
 };
 
-int main() {
+using SmallString = BasicSmallString<>;
+using ArenaString = BasicSmallString<ArenaAllocator<char>>;
+
+static_assert(sizeof(SmallString) == 24, "SmallString must stay three words");
+static_assert(SmallString::ssoThreshold == sizeof(SmallString) - 1, "all but the tag byte hold characters");
+
+namespace bench {
+
+// Bumped by the replacement operator new below.
+atomic<size_t> allocatedBytes{0};
+
+// Kept out of line: once inlined into a delete expression, GCC pairs this
+// free() with the matching new expression and warns about the mismatch.
+[[gnu::noinline]] inline void countedFree(void* p) noexcept {
+  free(p);
+}
+
+struct Distribution {
+  const char* name;
+  size_t (*length)(mt19937&);
+};
+
+// Key lengths seen in our stores: fixed-width ids, dictionary words, prefixed
+// user keys and path-like keys with a long tail.
+const Distribution distributions[] = {
+  { "hex id (16)",       [](mt19937&) -> size_t { return 16; } },
+  { "uuid (36)",         [](mt19937&) -> size_t { return 36; } },
+  { "word (3-12)",       [](mt19937& rng) -> size_t { return uniform_int_distribution<size_t>(3, 12)(rng); } },
+  { "user:<id> (6-25)",  [](mt19937& rng) -> size_t { return 5 + uniform_int_distribution<size_t>(1, 20)(rng); } },
+  { "path (~20, tail)",  [](mt19937& rng) -> size_t {
+      double len = lognormal_distribution<double>(3.0, 0.5)(rng);
+      return static_cast<size_t>(min(len, 256.0)) + 1;
+    } },
+};
+
+// Footprint of the previous layout: size, capacity, flag and a 16-byte union
+// (40 bytes), with 15 characters inline.
+size_t previousLayoutBytes(size_t len) {
+  return 40 + (len > 15 ? len + 1 : 0);
+}
+
+template<typename Str>
+size_t measure(const vector<string>& keys) {
+
+  size_t before = allocatedBytes.load();
+  vector<Str> stored;
+  stored.reserve(keys.size());
+  for (const string& key : keys) stored.emplace_back(key.c_str());
+  size_t heap = allocatedBytes.load() - before - keys.size() * sizeof(Str);
+
+  return keys.size() * sizeof(Str) + heap;
+}
+
+void footprint() {
+
+  const size_t count = 1000000;
+  mt19937 rng(2024);
+
+  cout << "sizeof(SmallString) = " << sizeof(SmallString) << ", inline capacity "
+       << SmallString::ssoThreshold << "; sizeof(std::string) = " << sizeof(string) << endl;
+  cout << "bytes per key over " << count << " keys (object + heap):" << endl;
+  cout << left << setw(20) << "distribution" << right
+       << setw(10) << "previous" << setw(13) << "SmallString" << setw(13) << "std::string" << endl;
+
+  for (const Distribution& dist : distributions) {
+
+    vector<string> keys;
+    keys.reserve(count);
+    size_t previous = 0;
+    for (size_t i = 0; i < count; ++i) {
+      size_t len = dist.length(rng);
+      string key(len, 'a');
+      for (char& c : key) c = static_cast<char>('a' + rng() % 26);
+      previous += previousLayoutBytes(len);
+      keys.push_back(move(key));
+    }
+
+    cout << left << setw(20) << dist.name << right << fixed << setprecision(1)
+         << setw(10) << double(previous) / count
+         << setw(13) << double(measure<SmallString>(keys)) / count
+         << setw(13) << double(measure<string>(keys)) / count << endl;
+  }
+}
+
+// Comma-separated records shaped like our ingest feed: an id, a name, an
+// email, a city, a URL and a free-text note. Most fields overflow the inline
+// buffer.
+vector<string> makeRecords(size_t count, mt19937& rng) {
+
+  const size_t minLen[] = { 8, 5, 15, 4, 30, 0 };
+  const size_t maxLen[] = { 8, 20, 35, 15, 80, 60 };
+
+  vector<string> records;
+  records.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    string record;
+    for (size_t f = 0; f < 6; ++f) {
+      if (f) record += ',';
+      size_t len = uniform_int_distribution<size_t>(minLen[f], maxLen[f])(rng);
+      for (size_t c = 0; c < len; ++c) record += static_cast<char>('a' + rng() % 26);
+    }
+    records.push_back(move(record));
+  }
+  return records;
+}
+
+// Splits every record of a batch into fields and keeps them until the batch
+// is done, the way a request handler would.
+template<typename Str, typename... AllocArg>
+void parseBatch(const vector<string>& records, vector<Str>& fields, string& line, AllocArg&... alloc) {
+
+  for (const string& record : records) {
+    line = record;
+    char* field = &line[0];
+    for (char* p = field; ; ++p) {
+      if (*p == ',' || *p == '\0') {
+        bool last = *p == '\0';
+        *p = '\0';
+        fields.emplace_back(field, alloc...);
+        if (last) break;
+        field = p + 1;
+      }
+    }
+  }
+}
+
+void throughput() {
+
+  const size_t batchSize = 10000;
+  const int rounds = 50;
+  mt19937 rng(7);
+  vector<string> records = makeRecords(batchSize, rng);
+
+  auto time = [&](auto parse) {
+    double best = 1e30;
+    for (int rep = 0; rep < 3; ++rep) {
+      auto start = chrono::steady_clock::now();
+      for (int round = 0; round < rounds; ++round) parse();
+      best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return double(batchSize) * rounds / best;
+  };
+
+  string line;
+  vector<SmallString> globalFields;
+  globalFields.reserve(batchSize * 6);
+  double global = time([&] {
+    parseBatch(records, globalFields, line);
+    globalFields.clear();
+  });
+
+  Arena arena;
+  ArenaAllocator<char> alloc(arena);
+  vector<ArenaString> arenaFields;
+  arenaFields.reserve(batchSize * 6);
+  double pooled = time([&] {
+    parseBatch(records, arenaFields, line, alloc);
+    arenaFields.clear();
+    arena.release();
+  });
+
+  cout << endl << "parsing " << batchSize << "-record batches (6 fields each):" << endl;
+  cout << fixed << setprecision(0)
+       << "  global allocator: " << global << " records/s" << endl
+       << "  arena:            " << pooled << " records/s (" << setprecision(2) << pooled / global << "x)" << endl;
+}
+
+int run() {
+  footprint();
+  throughput();
+  return 0;
+}
+
+} // namespace bench
+
+namespace selftest {
+
+const char* const longText = "a field long enough to need a heap buffer";
+
+// A string assigned from a request-scoped arena must stay readable after
+// that arena is gone.
+bool assignmentKeepsTheTargetArena() {
+
+  Arena longLived;
+  ArenaAllocator<char> keep(longLived);
+  ArenaString copied("short", keep);
+  ArenaString moved(keep);
+
+  {
+    Arena request;
+    ArenaString fromRequest(longText, ArenaAllocator<char>(request));
+    copied = fromRequest;
+    moved = move(fromRequest);
+  }
+
+  // Reuse the freed memory so a dangling buffer would read back garbage.
+  Arena scratch;
+  memset(scratch.allocate(Arena::defaultChunkSize), 'x', Arena::defaultChunkSize);
+
+  return strcmp(copied.cStr(), longText) == 0 && strcmp(moved.cStr(), longText) == 0
+      && copied.getAllocator() == keep && moved.getAllocator() == keep;
+}
+
+// Within one arena a move hands the buffer over instead of copying it.
+bool moveWithinAnArenaStealsTheBuffer() {
+
+  Arena arena;
+  ArenaAllocator<char> alloc(arena);
+  ArenaString source(longText, alloc);
+  ArenaString target(alloc);
+  const char* buffer = source.cStr();
+
+  target = move(source);
+  return target.cStr() == buffer && source.getSize() == 0;
+}
+
+bool assignmentHandlesEveryMode() {
+
+  const char* values[] = { "", "tiny", "exactly twenty-three ch", longText };
+  for (const char* to : values) {
+    for (const char* from : values) {
+      SmallString a(to), b(from);
+      a = b;
+      if (strcmp(a.cStr(), from) != 0 || a.getSize() != strlen(from)) return false;
+      SmallString c(to);
+      c = move(b);
+      if (strcmp(c.cStr(), from) != 0 || b.getSize() != 0) return false;
+    }
+  }
+
+  SmallString self(longText);
+  const SmallString& alias = self;
+  self = alias;
+  return strcmp(self.cStr(), longText) == 0;
+}
+
+struct Check {
+  const char* name;
+  bool (*run)();
+};
+
+int run() {
+
+  const Check checks[] = {
+    { "assignment keeps the target arena", assignmentKeepsTheTargetArena },
+    { "move within an arena steals the buffer", moveWithinAnArenaStealsTheBuffer },
+    { "assignment handles every mode", assignmentHandlesEveryMode },
+  };
+
+  int failures = 0;
+  for (const Check& check : checks) {
+    bool ok = check.run();
+    cout << (ok ? "ok      " : "FAILED  ") << check.name << endl;
+    failures += !ok;
+  }
+  return failures ? 1 : 0;
+}
+
+} // namespace selftest
+
+void* operator new(size_t size) {
+  bench::allocatedBytes.fetch_add(size, memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept { bench::countedFree(p); }
+void operator delete[](void* p) noexcept { bench::countedFree(p); }
+void operator delete(void* p, size_t) noexcept { bench::countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { bench::countedFree(p); }
+
+int main(int argc, char* argv[]) {
+
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    return bench::run();
+  if (argc > 1 && strcmp(argv[1], "--selftest") == 0)
+    return selftest::run();
 
   cout << "Enter your text (multiple words allowed):" << endl;
   cout << ">> ";